@@ -15,28 +15,235 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <err.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include "xmlparse.h"
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#define	XMLSCANSIMD
+#endif
 
 #define MAXATTR 255             // max attributes in any token
 #define MAXLEVEL 1000           // nesting depth
 
 char XMLATTREMOVE[] = "";
+char *(*xmlgetenv)(const char *) = getenv;    // variable lookup for $variable expansion when parsing
 
-static xmltoken *gettoken(void)
-{
-   xmltoken *h = malloc(sizeof(*h));
-   if (!h)
+#define ARENACHUNK 65536        // default first chunk size
+#define ARENAMAX 1048576        // max chunk size for growth
+#define ARENAALIGN 16
+// Tokens stay pointer linked rather than an array with 32 bit indexes and side tables, xmlparse --bench shows
+// walking them is well under 1% of running a page, so not worth changing every tag handler in xmlsql.c
+#define TOKENBLOCK 16           // first block of tokens
+#define TOKENBLOCKMAX 256       // max tokens in a block
+
+typedef struct xmlarenachunk_s {
+   struct xmlarenachunk_s *next;
+   size_t used;                 // bytes used in data
+   size_t size;                 // bytes in data
+   char data[] __attribute__((aligned(ARENAALIGN)));
+} xmlarenachunk;
+
+struct xmlarena_s {
+   xmlarenachunk *chunk;        // current chunk first
+   size_t size;                 // next chunk size
+};
+
+xmlarena *xmlarenanew(size_t size)
+{                               // new empty arena
+   xmlarena *a = malloc(sizeof(*a));
+   if (!a)
       errx(1, "malloc");
-   memset(h, 0, sizeof(*h));
+   a->chunk = NULL;
+   a->size = size ? (size + ARENAALIGN - 1) / ARENAALIGN * ARENAALIGN : ARENACHUNK;
+   return a;
+}
+
+void *xmlarenaalloc(xmlarena * a, size_t len)
+{                               // allocate zeroed memory from arena
+   len = (len + ARENAALIGN - 1) / ARENAALIGN * ARENAALIGN;
+   xmlarenachunk *c = a->chunk;
+   if (!c || c->used + len > c->size)
+   {                            // new chunk
+      size_t size = a->size;
+      if (len > size / 4)
+      {                         // large, own chunk, after the current one so its space is not wasted
+         c = calloc(1, sizeof(*c) + len);
+         if (!c)
+            errx(1, "malloc");
+         c->size = c->used = len;
+         if (a->chunk)
+         {
+            c->next = a->chunk->next;
+            a->chunk->next = c;
+         } else
+            a->chunk = c;
+         return c->data;
+      }
+      c = calloc(1, sizeof(*c) + size);
+      if (!c)
+         errx(1, "malloc");
+      c->size = size;
+      c->next = a->chunk;
+      a->chunk = c;
+      if (size < ARENAMAX)
+         a->size = size * 2;
+   }
+   void *p = c->data + c->used;
+   c->used += len;
+   return p;
+}
+
+char *xmlarenastrdup(xmlarena * a, const char *s)
+{                               // copy string in to arena
+   size_t l = strlen(s) + 1;
+   char *d = xmlarenaalloc(a, l);
+   memcpy(d, s, l);
+   return d;
+}
+
+int xmlarenaowns(xmlarena * a, const void *p)
+{                               // is p in memory allocated from the arena
+   xmlarenachunk *c;
+   for (c = a->chunk; c; c = c->next)
+      if ((const char *) p >= c->data && (const char *) p < c->data + c->used)
+         return 1;
+   return 0;
+}
+
+void xmlarenafree(xmlarena * a)
+{                               // free arena and everything allocated from it
+   if (!a)
+      return;
+   while (a->chunk)
+   {
+      xmlarenachunk *n = a->chunk->next;
+      free(a->chunk);
+      a->chunk = n;
+   }
+   free(a);
+}
+
+// Scan for the next c or end of string, counting newlines on the way - text between tags is mostly long runs with neither
+__attribute__((unused))
+static char *scanscalar(char *h, char c, int *line)
+{
+   while (*h && *h != c)
+   {
+      if (*h == '\n')
+         (*line)++;
+      h++;
+   }
    return h;
 }
 
-xmltoken *xmlparse(char *h, char *filename)
+#ifdef	XMLSCANSIMD
+// Blocks are aligned so never read past the page the terminating NUL is in, but may read past the end of the allocation
+__attribute__((no_sanitize_address))
+static char *scansse2(char *h, char c, int *line)
+{                               // 16 bytes at a time
+   while ((uintptr_t) h & 15)
+   {
+      if (!*h || *h == c)
+         return h;
+      if (*h == '\n')
+         (*line)++;
+      h++;
+   }
+   const __m128i z = _mm_setzero_si128(),
+       q = _mm_set1_epi8(c),
+       nl = _mm_set1_epi8('\n');
+   while (1)
+   {
+      __m128i b = _mm_load_si128((const __m128i *) h);
+      unsigned int stop = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, z), _mm_cmpeq_epi8(b, q)));
+      unsigned int n = _mm_movemask_epi8(_mm_cmpeq_epi8(b, nl));
+      if (stop)
+      {
+         int o = __builtin_ctz(stop);
+         *line += __builtin_popcount(n & ((1U << o) - 1));
+         return h + o;
+      }
+      *line += __builtin_popcount(n);
+      h += 16;
+   }
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static char *scanavx2(char *h, char c, int *line)
+{                               // 32 bytes at a time
+   while ((uintptr_t) h & 31)
+   {
+      if (!*h || *h == c)
+         return h;
+      if (*h == '\n')
+         (*line)++;
+      h++;
+   }
+   const __m256i z = _mm256_setzero_si256(),
+       q = _mm256_set1_epi8(c),
+       nl = _mm256_set1_epi8('\n');
+   while (1)
+   {
+      __m256i b = _mm256_load_si256((const __m256i *) h);
+      unsigned int stop = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(b, z), _mm256_cmpeq_epi8(b, q)));
+      unsigned int n = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl));
+      if (stop)
+      {
+         int o = __builtin_ctz(stop);
+         *line += __builtin_popcount(n & ((1U << o) - 1));
+         return h + o;
+      }
+      *line += __builtin_popcount(n);
+      h += 32;
+   }
+}
+#endif
+
+static char *scanpick(char *h, char c, int *line);
+static char *(*scan)(char *h, char c, int *line) = scanpick;
+static const char *scanname = "scalar";
+
+static char *scanpick(char *h, char c, int *line)
+{                               // choose scanner for this CPU on first use
+#ifdef	XMLSCANSIMD
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+   {
+      scan = scanavx2;
+      scanname = "avx2";
+   } else
+   {
+      scan = scansse2;
+      scanname = "sse2";
+   }
+#else
+   scan = scanscalar;
+#endif
+   return scan(h, c, line);
+}
+
+xmltoken *xmlparse(char *h, char *filename, xmlarena * arena)
 {                               // parse XML and return token list
    xmltoken *n = 0,
        *p = (xmltoken *) & n,
        *t = NULL;
    int line = 1;
+   xmltoken *block = NULL;
+   int blockfree = 0,
+       blocksize = TOKENBLOCK;
+   xmltoken *gettoken(void) {  // tokens are allocated in blocks, so in order in memory, apart from the attributes
+      if (!blockfree)
+      {
+         block = xmlarenaalloc(arena, blocksize * sizeof(xmltoken));
+         blockfree = blocksize;
+         if (blocksize < TOKENBLOCKMAX)
+            blocksize *= 2;
+      }
+      blockfree--;
+      return block++;
+   }
 
    while (*h)
    {
@@ -48,12 +255,8 @@ xmltoken *xmlparse(char *h, char *filename)
          t->line = line;
          t->type = XML_COMMENT;
          t->content = h + 3;
-         while (*h && !(*h == '-' && h[1] == '-' && h[2] == '>'))
-         {
-            if (*h == '\n')
-               line++;
+         while (*(h = scan(h, '-', &line)) && !(h[1] == '-' && h[2] == '>'))
             h++;
-         }
          if (*h)
          {
             *h = 0;
@@ -136,7 +339,7 @@ xmltoken *xmlparse(char *h, char *filename)
                         warnx("Line %d use of $variable not allowed in %.20s [%.20s...]", line, tag, h);
                      else
                      {
-                        char *val = getenv(env);
+                        char *val = xmlgetenv(env);
                         if (!val)
                            warnx("Line %d Not found $%s in %s [%.20s...]", line, env, tag, h);
                         free(env);
@@ -144,7 +347,7 @@ xmltoken *xmlparse(char *h, char *filename)
                         if (val)
                         {
                            hwas = h;
-                           h = strdup(val); // Not freeed, I know
+                           h = xmlarenastrdup(arena, val);
                         }
                         continue;
                      }
@@ -176,6 +379,7 @@ xmltoken *xmlparse(char *h, char *filename)
                break;
             }
             a[n].value = 0;
+            a[n].expand = 0;
             if (*h == '"' || *h == '\'')
             {
                char q = *h++;
@@ -209,12 +413,7 @@ xmltoken *xmlparse(char *h, char *filename)
                a[n].value = h;
                if (quote)
                {
-                  while (*h && *h != quote)
-                  {
-                     if (*h == '\n')
-                        line++;
-                     h++;
-                  }
+                  h = scan(h, quote, &line);
                   if (*h == quote)
                      *h++ = 0;
                } else
@@ -240,9 +439,7 @@ xmltoken *xmlparse(char *h, char *filename)
          if (n)
          {
             t->attrs = n;
-            t->attr = malloc(n * sizeof(*a));
-            if (!t->attr)
-               errx(1, "Malloc");
+            t->attr = xmlarenaalloc(arena, n * sizeof(*a));
             memmove(t->attr, a, n * sizeof(*a));
          }
          if ((type & XML_START) && !(type & XML_END) && !strcasecmp(tag, "SCRIPT"))
@@ -254,12 +451,8 @@ xmltoken *xmlparse(char *h, char *filename)
             t->filename = filename;
             t->line = line;
             t->content = h;
-            while (*h && strncasecmp(h, "</script>", 9))
-            {
-               if (*h == '\n')
-                  line++;
+            while (*(h = scan(h, '<', &line)) && strncasecmp(h, "</script>", 9))
                h++;
-            }
          }
       } else
       {                         // text
@@ -267,14 +460,12 @@ xmltoken *xmlparse(char *h, char *filename)
          t->filename = filename;
          t->line = line;
          t->content = h;
-         while (*h)
+         while (*(h = scan(h, '<', &line)))
          {
-            if (*h == '<' && h[1] == '!' && h[2] == '-' && h[3] == '-')
+            if (h[1] == '!' && h[2] == '-' && h[3] == '-')
                break;
-            if (*h == '<' && ((h[1] == '/' && isalpha(h[2])) || isalpha(h[1])))
+            if ((h[1] == '/' && isalpha(h[2])) || isalpha(h[1]))
                break;
-            if (*h == '\n')
-               line++;
             h++;
          }
       }
@@ -373,20 +564,6 @@ void xmlendmatch(xmltoken * n, const char *tags)
    }
 }
 
-void xmlfree(xmltoken * t)
-{                               // free token list
-   while (t)
-   {
-      xmltoken *n = t->next;
-      if (t->style)
-         free(t->style);
-      if (t->attr)
-         free(t->attr);
-      free(t);
-      t = n;
-   }
-}
-
 #if 0
 static char *stolower(char *s)
 {
@@ -626,7 +803,7 @@ void xmldeescape(char *i)
 }
 
 // See if there is a style attribute, and if so, expand it as tag=value for tag:value in the style
-void xmlstyle(xmltoken * t)
+void xmlstyle(xmltoken * t, xmlarena * arena)
 {
    if (t->type & XML_START)
    {
@@ -637,12 +814,8 @@ void xmlstyle(xmltoken * t)
          int n = 0;
          xmlattr a[MAXATTR];
          s->value = 0;          // deleted attribute
-         if (t->style)
-         {
-            free(t->style);
-            t->style = 0;
-            t->styles = 0;
-         }
+         t->style = 0;
+         t->styles = 0;
          while (*p)
          {
             char *q = p,
@@ -662,23 +835,24 @@ void xmlstyle(xmltoken * t)
                break;
             a[n].attribute = p;
             a[n].value = v;
+            a[n].expand = 0;
             n++;
             p = q;
          }
          t->styles = n;
          if (n)
          {
-            t->style = malloc(sizeof(xmlattr) * n);
+            t->style = xmlarenaalloc(arena, sizeof(xmlattr) * n);
             memmove(t->style, a, sizeof(xmlattr) * n);
          }
       }
    }
 }
 
-void xmlstyleall(xmltoken * t)
+void xmlstyleall(xmltoken * t, xmlarena * arena)
 {
    for (; t; t = t->next)
-      xmlstyle(t);
+      xmlstyle(t, arena);
 }
 
 static struct {
@@ -1009,10 +1183,127 @@ static struct {
     0xFF, "yuml" },
 };
 
+// Perfect hashes of utf[] by name and by code point, built on first use
+// Keys hash to one of UTFBUCKETS buckets, and each bucket has a displacement chosen so its keys land in free slots
+#define UTFBUCKETS 64
+#define UTFSLOTS 512            // power of 2, over twice the entries
+typedef struct {
+   unsigned short disp[UTFBUCKETS];
+   short slot[UTFSLOTS];        // utf[] index + 1, 0 for empty
+} utfhash_t;
+static utfhash_t utfbyname,
+ utfbycode;
+
+static inline uint32_t utfmix(uint32_t h)
+{                               // spread the bits
+   h ^= h >> 16;
+   h *= 0x85EBCA6B;
+   h ^= h >> 13;
+   h *= 0xC2B2AE35;
+   h ^= h >> 16;
+   return h;
+}
+
+static inline uint32_t utfnamehash(const char *t, int n)
+{                               // FNV-1a
+   uint32_t h = 2166136261U;
+   while (n--)
+      h = (h ^ (unsigned char) *t++) * 16777619U;
+   return h;
+}
+
+static inline int utffind(utfhash_t * t, uint32_t h)
+{                               // utf[] index for key with hash h, if there is one, -1 if not
+   return t->slot[utfmix(h + t->disp[h % UTFBUCKETS] * 0x9E3779B9U) & (UTFSLOTS - 1)] - 1;
+}
+
+static void utfbuild(utfhash_t * t, uint32_t * h, char *skip, int n)
+{                               // build perfect hash where h[e] is the hash for utf[e], except where skip[e] is set
+   int b,
+    e,
+    order[UTFBUCKETS],
+    size[UTFBUCKETS] = { 0 };
+   for (e = 0; e < n; e++)
+      if (!skip[e])
+         size[h[e] % UTFBUCKETS]++;
+   for (b = 0; b < UTFBUCKETS; b++)
+   {                            // biggest buckets first, while there are most free slots
+      int q = b;
+      while (q && size[order[q - 1]] < size[b])
+      {
+         order[q] = order[q - 1];
+         q--;
+      }
+      order[q] = b;
+   }
+   for (b = 0; b < UTFBUCKETS && size[order[b]]; b++)
+   {
+      int k = order[b],
+          d;
+      for (d = 0; d < 65536; d++)
+      {                         // try displacements until all keys in the bucket go to different free slots
+         int s[n],
+          c = 0,
+             ok = 1;
+         for (e = 0; e < n && ok; e++)
+            if (!skip[e] && h[e] % UTFBUCKETS == k)
+            {
+               int q = utfmix(h[e] + d * 0x9E3779B9U) & (UTFSLOTS - 1),
+                   z;
+               if (t->slot[q])
+                  ok = 0;
+               for (z = 0; z < c && ok; z++)
+                  if (s[z] == q)
+                     ok = 0;
+               s[c++] = q;
+            }
+         if (!ok)
+            continue;
+         t->disp[k] = d;
+         for (c = 0, e = 0; e < n; e++)
+            if (!skip[e] && h[e] % UTFBUCKETS == k)
+               t->slot[s[c++]] = e + 1;
+         break;
+      }
+      if (d == 65536)
+         errx(1, "Cannot build entity table");
+   }
+}
+
+static void utfbuildall(void)
+{                               // build the hashes, from utfinit
+   int n = sizeof(utf) / sizeof(*utf),
+       e,
+       p;
+   uint32_t h[n];
+   char skip[n];
+   for (e = 0; e < n; e++)
+   {                            // first entry for a name is used
+      for (p = 0; p < e && strcmp(utf[p].t, utf[e].t); p++);
+      h[e] = utfnamehash(utf[e].t, strlen(utf[e].t));
+      skip[e] = (p < e);
+   }
+   utfbuild(&utfbyname, h, skip, n);
+   for (e = 0; e < n; e++)
+   {                            // first name for a code point is used
+      for (p = 0; p < e && utf[p].u != utf[e].u; p++);
+      h[e] = utfmix(utf[e].u);
+      skip[e] = (p < e);
+   }
+   utfbuild(&utfbycode, h, skip, n);
+}
+
+static void utfinit(void)
+{                               // build the hashes once, even with several threads
+   static pthread_once_t once = PTHREAD_ONCE_INIT;
+   pthread_once(&once, utfbuildall);
+}
+
 void xmlutf8(char *i)
 {                               // in situ page &xxx; in to UTF-8
-   if (i)
-   {
+   if (i && (i = strchr(i, '&')))
+   {                            // nothing to do before the first &
+      utfinit();
       char *o = i;
       while (*i)
       {
@@ -1038,13 +1329,9 @@ void xmlutf8(char *i)
                   }
                } else
                {
-                  int p;
-                  for (p = 0; p < sizeof(utf) / sizeof(*utf); p++)
-                     if (strlen(utf[p].t) == n && !strncmp(t, utf[p].t, n))
-                     {
-                        u = utf[p].u;
-                        break;
-                     }
+                  int p = utffind(&utfbyname, utfnamehash(t, n));
+                  if (p >= 0 && !strncmp(t, utf[p].t, n) && !utf[p].t[n])
+                     u = utf[p].u;
                }
                if (u)
                {                // UTF encode
@@ -1133,9 +1420,9 @@ void xmlutf8out(FILE * f, unsigned char *p)
             p += 1;
          } else
             v = *p;             // silly
-         int p;
-         for (p = 0; p < sizeof(utf) / sizeof(*utf) && utf[p].u != v; p++);
-         if (p < sizeof(utf) / sizeof(*utf))
+         utfinit();
+         int p = utffind(&utfbycode, utfmix(v));
+         if (p >= 0 && utf[p].u == v)
             fprintf(f, "&%s;", utf[p].t);
          else
             fprintf(f, "&#x%lX;", v);
@@ -1184,8 +1471,8 @@ char *xmlloadfile(char *fn, size_t *len)
       if (l && p == l)
          break;                 // end of file
       if (p == a)
-      {
-         a += 10240;
+      {                         // unknown size, e.g. a pipe
+         a *= 2;
          m = realloc(m, a + 1);
          if (!m)
          {
@@ -1212,15 +1499,164 @@ char *xmlloadfile(char *fn, size_t *len)
 
 
 #ifndef LIB
+static double bench(char **files, int count)
+{                               // parse all files repeatedly for a second, return MB/s
+   size_t total = 0,
+       done = 0;
+   char **data = malloc(count * sizeof(*data)),
+       *copy = NULL;
+   size_t *len = malloc(count * sizeof(*len));
+   int f;
+   for (f = 0; f < count; f++)
+   {
+      if (!(data[f] = xmlloadfile(files[f], &len[f])))
+         err(1, "%s", files[f]);
+      total += len[f];
+   }
+   struct timespec s,
+    e;
+   clock_gettime(CLOCK_MONOTONIC, &s);
+   double t = 0;
+   while (t < 1)
+   {
+      for (f = 0; f < count; f++)
+      {                         // parse writes in to the source, so parse a copy
+         copy = realloc(copy, len[f] + 1);
+         memcpy(copy, data[f], len[f] + 1);
+         xmlarena *arena = xmlarenanew(0);
+         xmlparse(copy, files[f], arena);
+         xmlarenafree(arena);
+      }
+      done += total;
+      clock_gettime(CLOCK_MONOTONIC, &e);
+      t = (e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9;
+   }
+   for (f = 0; f < count; f++)
+      free(data[f]);
+   free(data);
+   free(len);
+   free(copy);
+   return done / t / 1e6;
+}
+
+static void benchwalk(char **files, int count)
+{                               // walk the parsed tokens as processxml does, following next and reading the fields used to run
+   xmlarena *arena = xmlarenanew(0);
+   xmltoken **tokens = malloc(count * sizeof(*tokens));
+   char **data = malloc(count * sizeof(*data));
+   size_t n = 0,
+       done = 0;
+   int f;
+   for (f = 0; f < count; f++)
+   {
+      if (!(data[f] = xmlloadfile(files[f], NULL)))
+         err(1, "%s", files[f]);
+      tokens[f] = xmlparse(data[f], files[f], arena);  // the tokens point in to data
+      xmlendmatch(tokens[f], 0);
+      xmltoken *t;
+      for (t = tokens[f]; t; t = t->next)
+         n++;
+   }
+   struct timespec s,
+    e;
+   clock_gettime(CLOCK_MONOTONIC, &s);
+   double t = 0;
+   volatile unsigned long sum = 0;
+   while (n && t < 1)
+   {
+      for (f = 0; f < count; f++)
+      {
+         xmltoken *x;
+         unsigned long v = 0;
+         for (x = tokens[f]; x; x = x->next)
+            v += x->type + x->tag + x->attrs + (x->end != NULL) + *x->content;
+         sum += v;
+      }
+      done += n;
+      clock_gettime(CLOCK_MONOTONIC, &e);
+      t = (e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9;
+   }
+   for (f = 0; f < count; f++)
+      free(data[f]);
+   free(data);
+   free(tokens);
+   xmlarenafree(arena);
+   printf("token walk %.2f ns per token, %lu tokens\n", done ? t * 1e9 / done : 0, (unsigned long) n);
+}
+
+static void benchentities(void)
+{                               // xmlutf8 on text with entities, and xmlutf8out on non latin text, MB/s
+   const char *sample[] = {
+      "Caf&eacute; &amp; cr&egrave;me br&ucirc;l&eacute;e &lt;b&gt;&hellip;&lt;/b&gt; &copy; 2024 &mdash; &euro;5&nbsp;each &#x263A; ",
+      "\u039a\u03b1\u03bb\u03b7\u03bc\u03ad\u03c1\u03b1 \u0417\u0434\u0440\u0430\u0432\u0441\u0442\u0432\u0443\u0439\u0442\u0435 \u65e5\u672c\u8a9e \u00e9\u00e8\u00fc \u2014 \u201cquoted\u201d \u2026 ",
+   };
+   FILE *null = fopen("/dev/null", "w");
+   if (!null)
+      err(1, "/dev/null");
+   int s;
+   for (s = 0; s < 2; s++)
+   {
+      size_t l = strlen(sample[s]),
+          reps = 65536 / l + 1,
+          r;
+      char *text = malloc(l * reps + 1),
+          *copy = malloc(l * reps + 1);
+      for (r = 0; r < reps; r++)
+         memcpy(text + r * l, sample[s], l);
+      text[l * reps] = 0;
+      struct timespec a,
+       e;
+      double t = 0;
+      size_t done = 0;
+      clock_gettime(CLOCK_MONOTONIC, &a);
+      while (t < 1)
+      {
+         if (s)
+            xmlutf8out(null, (unsigned char *) text);
+         else
+         {
+            memcpy(copy, text, l * reps + 1);
+            xmlutf8(copy);
+         }
+         done += l * reps;
+         clock_gettime(CLOCK_MONOTONIC, &e);
+         t = (e.tv_sec - a.tv_sec) + (e.tv_nsec - a.tv_nsec) / 1e9;
+      }
+      printf("%s %.1f MB/s\n", s ? "xmlutf8out non latin" : "xmlutf8 entities", done / t / 1e6);
+      free(text);
+      free(copy);
+   }
+   fclose(null);
+}
+
 int main(int argc, char *argv[])
 {
    int a;
+   if (argc > 1 && !strcmp(argv[1], "--bench-entities"))
+   {
+      benchentities();
+      return 0;
+   }
+   if (argc > 2 && !strcmp(argv[1], "--bench"))
+   {                            // parse throughput, xmlparse --bench files...
+      char *h = "";
+      int l = 0;
+      scan(h, 0, &l);           // pick scanner
+      const char *name = scanname;
+      double fast = bench(argv + 2, argc - 2);
+      scan = scanscalar;
+      double slow = bench(argv + 2, argc - 2);
+      printf("%s %.1f MB/s, scalar %.1f MB/s\n", name, fast, slow);
+      benchwalk(argv + 2, argc - 2);
+      return 0;
+   }
    for (a = 1; a < argc; a++)
    {
       char *m = xmlloadfile(strcmp(argv[a], "-") ? argv[a] : 0, 0);
       if (m)
       {
-         xmltoken *t = xmlparse(m, argv[a]);
+         xmlarena *arena = xmlarenanew(0);
+         xmltoken *t = xmlparse(m, argv[a], arena);
          xmlendmatch(t, 0);
          {
             xmltoken *n = t;
@@ -1235,7 +1671,7 @@ int main(int argc, char *argv[])
                n = n->next;
             }
          }
-         xmlfree(t);
+         xmlarenafree(arena);
          free(m);
       } else
          perror(argv[a]);
@@ -7,26 +7,33 @@ typedef struct xmlattr_s
 {
    char *attribute;             // pointer to attribute name, or null for deleted attribute
    char *value;                 // pointer to content, or null if just a word without =value
+   void *expand;                // application specific compiled value, 0 if not set
 } xmlattr;
 
 typedef struct xmltoken_s
-{
+{                               // fields used when running a script first, next to content to end are all a text token needs
    struct xmltoken_s *next;     // next token in file
    char *content;               // tag name for tags, or text start for text
    unsigned int type:8;
    unsigned int utf8:1;         // content is UTF8 encoded and needs escaping on output
+   unsigned int tag:8;          // application specific tag code, 0 if not set
    unsigned int attrs;          // number of attributes
-   unsigned int styles;         // number of styles
-   struct xmltoken_s *start;    // pointer to start token if this is end, or null if not found
    struct xmltoken_s *end;      // pointer to end token if this is start, or null if not found
-   xmlattr *style;              // points to style array if xmlstyle has been called, else 0
+   void *index;                 // application specific attribute index, 0 if not set
+   xmlattr *attr;               // extends to number of attributes
+   // used when parsing, and for messages
+   struct xmltoken_s *start;    // pointer to start token if this is end, or null if not found
    char *filename;              // filename
    int line;                    // line number
    int level;			// indent level
-   xmlattr *attr;               // extends to number of attributes
+   unsigned int styles;         // number of styles
+   xmlattr *style;              // points to style array if xmlstyle has been called, else 0
 } xmltoken;
 
+typedef struct xmlarena_s xmlarena;  // bump allocator, owns tokens, attributes and strings of a parsed document
+
 extern char XMLATTREMOVE[];     // used in xmlwrite as attribute meaning remove it
+extern char *(*xmlgetenv) (const char *);       // used for $variable expansion when parsing, getenv by default
 
 #define XML_TEXT	0
 #define	XML_START	1       // bit flag, valid for start and end in same token <TAG ... />
@@ -34,15 +41,19 @@ extern char XMLATTREMOVE[];     // used in xmlwrite as attribute meaning remove
 #define	XML_COMMENT	4       // bit flag, valid on it's own
 
 
-xmltoken *xmlparse (char *xml, char *filename); // parse XML and return token list - writes to and references memory image of source
-void xmlfree (xmltoken * token);        // free token list
+xmlarena *xmlarenanew (size_t size);    // new arena, size is first chunk size, or 0 for default
+void *xmlarenaalloc (xmlarena *, size_t);       // allocate zeroed memory from arena
+char *xmlarenastrdup (xmlarena *, const char *);        // copy string in to arena
+void xmlarenafree (xmlarena *); // free arena and everything allocated from it
+int xmlarenaowns (xmlarena *, const void *);    // is memory allocated from this arena
+xmltoken *xmlparse (char *xml, char *filename, xmlarena *);     // parse XML and return token list - writes to and references memory image of source, tokens allocated from arena
 void xmlwrite (FILE *, xmltoken *, ...);        // write token to file, optional attr,value pairs to override attributes, null attr terminated. if token null, next is tag iiteral name
 void xmlwriteattr (FILE *, char *, char *);     // write attribute as part of a tag
 xmlattr *xmlfindattrbp (xmltoken *, char *, char **);   // find an attribute, null for not found, stop at breakpoint
 #define xmlfindattr(x,t) xmlfindattrbp(x,t,0)
 void xmldeescape (char *i);     // in situ de-escape of common xml & encoding
-void xmlstyle (xmltoken * t);   // expand style attribute if present
-void xmlstyleall (xmltoken * t);        // expand style on whole token chain
+void xmlstyle (xmltoken * t, xmlarena *);       // expand style attribute if present
+void xmlstyleall (xmltoken * t, xmlarena *);    // expand style on whole token chain
 void xmlutf8 (char *c);         // in situ expact &xxx; to UTF8
 void xmlutf8all (xmltoken * t); // expand all text in token chain
 char *xmlloadfile (char *fn, size_t * len);     // load a file, if fn 0 then stdin, in to malloced memory - sets length if not null
@@ -2,7 +2,9 @@
 // This software is provided under the terms of the GPL v2 or later.
 
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <popt.h>
@@ -25,6 +27,11 @@
 #include "sqlexpand.h"
 #include <stringdecimaleval.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
 
 const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
@@ -43,7 +50,12 @@ const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz01234
 #define	FLAG_XML	128     // Escape as XML object
 #define	FLAG_TEXTAREA	256     // Escape as input for textarea
 
-#define	MAXTEMP 50000
+#define	OUTBUF	65536           // Output buffer size
+#define	SCGIREQUESTS	10000   // Requests per SCGI worker before it is restarted
+#define	SCGIPOSTMAX	10000000        // Largest SCGI request body read for form data
+#define	SCGITIMEOUT	30      // Seconds to wait for each read of an SCGI request
+
+#define	ENDMATCH	"IF\tSQL\tWHILE\tFOR\tTEXTAREA\tSELECT\tLATER\tXMLSQL\tFORM\tDIR\tCACHE"    // Tags matched to their end tag
 
 #define Q(x) #x                 // Trick to quote defined fields
 #define QUOTE(x) Q(x)
@@ -97,16 +109,211 @@ const char *security = NULL;
 FILE *of = 0;
 int isxml = 0;
 int allowexec = 0;
+int contenttype = 0;
+const char *scgi = NULL;
+const char *templatecache = NULL;
+const char *cachedir = NULL;
+int scgiworkers = 1;
+int parallelsql = 0;
+int streaminput = 0;
+int schemattl = 60;
+int sqlstats = 0;
+int slowqueryms = 0;
+const char *slowquerylog = NULL;
+char sqltiming = 0;             // sqlstats or slowqueryms set
+unsigned long long outcounted = 0;      // bytes written through outcount stream
+char iflast = 0;                // result of last IF, for ELSE
 
 #define MAXLEVEL 10
 int level = 0;
-MYSQL sql;
+MYSQL sql[MAXLEVEL];            // connections, [n] is used while n STREAM results are open
 MYSQL_RES *res[MAXLEVEL];
 MYSQL_ROW row[MAXLEVEL];
 MYSQL_FIELD *field[MAXLEVEL];
 int fields[MAXLEVEL];
-char sqlconnected = { 0 };
+// Field name hash for each level, made when result is opened
+typedef struct
+{
+   uint32_t hash;
+   int f;                       // field number + 1, 0 for empty slot
+} fieldslot_t;
+fieldslot_t *fieldhash[MAXLEVEL];
+unsigned int fieldhashsize[MAXLEVEL];   // power of 2
+char *fielddate[MAXLEVEL];      // field is a date type, so 0000 date shows as blank
+char sqlconnected[MAXLEVEL] = { 0 };
 char sqlactive[MAXLEVEL] = { 0 };
+char sqlstream[MAXLEVEL] = { 0 };       // level has a STREAM result open, which holds its connection until freed
+int sqlstreams = 0;
+// Prepared statements, for SQL tags run more than once whose query only has plain $variable values, cached by token and connection
+typedef typeof (*((MYSQL_BIND *) 0)->is_null) sqlbool_t;      // my_bool or bool, depending on client library
+typedef struct
+{
+   const char *name;            // variable
+   char quoted;                 // was a whole '' string so bound as a string, else must be a number
+} sqlparam_t;
+typedef struct sqlprep_s
+{
+   struct sqlprep_s *next;
+   xmltoken *x;                 // SQL token
+   int conn;                    // connection number
+   int runs;                    // times run as text, prepared on the second
+   char failed;                 // query cannot be prepared
+   char *query;                 // query with ? for parameters
+   MYSQL_STMT *stmt;
+   int params;
+   sqlparam_t *param;
+   unsigned int cols;
+   MYSQL_BIND *bind;            // result columns, as strings
+   unsigned long *len;
+   sqlbool_t *null;
+   char **row;
+} sqlprep_t;
+#define	SQLPREPHASH	256
+#define	SQLPREPMAX	1000    // cached statements, more than this and all are dropped
+sqlprep_t *sqlprephash[SQLPREPHASH];
+int sqlpreps = 0;
+sqlprep_t *sqlprepres[MAXLEVEL];        // prepared statement that has the result for a level
+int sqlrows[MAXLEVEL];          // rows fetched for a level
+// BATCH, nested SQL run once for all rows of the outer SQL using IN (...), and its rows grouped by key
+typedef struct sqlbatchrow_s
+{
+   struct sqlbatchrow_s *next;
+   SQL_ROW row;
+} sqlbatchrow_t;
+typedef struct sqlbatchkey_s
+{
+   struct sqlbatchkey_s *next;  // hash chain
+   struct sqlbatchkey_s *nextkey;       // all keys in order
+   uint32_t hash;
+   const char *key;
+   sqlbatchrow_t *row,
+    **end;
+} sqlbatchkey_t;
+#define	SQLBATCHHASH	1024
+#define	SQLBATCHCHUNK	1000    // values per IN (...)
+typedef struct sqlbatch_s
+{
+   struct sqlbatch_s *next;
+   xmltoken *x;                 // SQL token
+   xmlarena *arena;             // everything else for this batch
+   char failed;                 // could not be done, run per row
+   const char *var;             // variable with the key value
+   char quoted;                 // variable was in quotes
+   int results;
+   SQL_RES **res;               // results, holding the rows
+   sqlbatchkey_t *keys,
+   **keyend;
+   sqlbatchkey_t *hash[SQLBATCHHASH];
+   sqlbatchrow_t *first,        // rows for current key
+     *pos;                      // next row to return
+} sqlbatch_t;
+sqlbatch_t *sqlbatches[MAXLEVEL];       // batches made from the rows of a level
+sqlbatch_t *sqlbatchres[MAXLEVEL];      // batch that has the rows for a level
+// MEMO, results kept for the rest of the run so the same query again does not go to the server
+typedef struct sqlmemo_s
+{
+   struct sqlmemo_s *next;
+   uint32_t hash;
+   char *query;
+   SQL_RES *res;
+   size_t bytes;                // approx size
+   char dropped;                // no longer in the memo, free when done
+} sqlmemo_t;
+#define	SQLMEMOHASH	256
+#define	SQLMEMOMAX	(16*1024*1024)  // bytes of results kept
+sqlmemo_t *sqlmemohash[SQLMEMOHASH];
+sqlmemo_t *sqlmemores[MAXLEVEL];        // memo that has the rows for a level
+size_t sqlmemobytes = 0;
+int sqlmemohits = 0,
+   sqlmemomisses = 0;
+// CACHE, results shared between processes for a time, a file per query in --cache-dir, mapped to read
+// Files are written to a temporary name and renamed in place, so readers need no locking
+#define	SQLCACHEMAGIC	"XMLSQLC1"
+#define	SQLCACHENONE	0xFFFFFFFF      // NULL pointer
+typedef struct
+{
+   char magic[8];
+   uint64_t expires;            // time_t
+   uint32_t fields,
+     rows,
+     buflen,
+     query;                     // the query, as file name is a hash
+} sqlcachehead_t;
+typedef struct
+{
+   uint32_t name,
+     org_name,
+     table,
+     org_table,
+     db;                        // offset in strings
+   uint32_t type,
+     flags,
+     decimals,
+     charsetnr;
+   uint64_t length,
+     max_length;
+} sqlcachefield_t;
+// followed by rows * fields uint32_t offsets of values, and then the strings
+typedef struct
+{
+   void *map;
+   size_t maplen;
+   unsigned int fields,
+     rows,
+     pos;
+   SQL_FIELD *field;
+   char **cell;                 // rows * fields
+} sqlcache_t;
+sqlcache_t *sqlcacheres[MAXLEVEL];      // cached result for a level
+// Schema cache, column details for enum SELECT and KEY templates, kept for schemattl seconds
+#define SCHEMAHASH 64
+typedef struct schema_s schema_t;
+struct schema_s
+{
+   schema_t *next;
+   char *key;                   // db\0table\0column, column empty for the table's fields
+   size_t keylen;
+   time_t when;
+   SQL_RES *res;                // fields of the table
+   char *type;                  // Type of the column
+};
+schema_t *schemahash[SCHEMAHASH];
+schema_t *schemares[MAXLEVEL];  // schema entry that has the fields for a level
+// SQL timing for each SQL tag, for --sql-stats
+#define SQLSTATHASH 256
+typedef struct sqlstat_s sqlstat_t;
+struct sqlstat_s
+{
+   sqlstat_t *next;
+   xmltoken *x;                 // NULL once the token is freed
+   char *where;                 // file:line, kept for the report as the token may be freed first
+   unsigned int runs;
+   unsigned long long rows;
+   long long bytes;
+   double query,                // seconds
+     fetch,
+     render;
+};
+sqlstat_t *sqlstathash[SQLSTATHASH];
+int sqlstatcount = 0;
+// Parallel SQL, top level SQL with constant queries started on their own connections when the script starts
+#define SQLPARALLELMAX 32
+typedef struct
+{
+   xmltoken *x;
+   char *query;                 // NULL once used
+   SQL_RES *res;
+   char *error;
+   char done;                   // set by the thread running it
+} sqlparallel_t;
+sqlparallel_t sqlparallel[SQLPARALLELMAX];
+int sqlparallels = 0;
+MYSQL sqlpar[SQLPARALLELMAX];   // connection for each thread, kept like sql[]
+char sqlparconnected[SQLPARALLELMAX] = { 0 };
+pthread_t sqlparthread[SQLPARALLELMAX];
+int sqlparthreads = 0;
+pthread_mutex_t sqlparmutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sqlparcond = PTHREAD_COND_INITIALIZER;
 
 typedef struct
 {
@@ -115,8 +322,102 @@ typedef struct
    char *selectvalue;
 } process_t;
 
+// Tag codes, set once after parsing, in xmltoken tag
+enum
+{
+   TAG_NONE,                    // not a tag we process
+   TAG_OUTPUT,
+   TAG_IF,
+   TAG_WHILE,
+   TAG_LATER,
+   TAG_FOR,
+   TAG_DIR,
+   TAG_SET,
+   TAG_EVAL,
+   TAG_SQL,
+   TAG_INCLUDE,
+   TAG_EXEC,
+   TAG_INPUT,
+   TAG_SELECT,
+   TAG_OPTION,
+   TAG_TEXTAREA,
+   TAG_FORM,
+   TAG_SCRIPT,
+   TAG_IMG,
+   TAG_CACHE,
+   TAG_MAX
+};
+
+// Attribute IDs, for attributes we look up, indexed per token after parsing
+enum
+{
+   ATT_NONE,                    // not an attribute we look up
+   ATT_ALL,
+   ATT_ALT,
+   ATT_ASC,
+   ATT_BASE64,
+   ATT_BATCH,
+   ATT_BLANK,
+   ATT_CACHE,
+   ATT_CHECKED,
+   ATT_CLASS,
+   ATT_CSV,
+   ATT_CSVHEAD,
+   ATT_DESC,
+   ATT_DISTINCT,
+   ATT_FAKESI,
+   ATT_FILE,
+   ATT_FORMAT,
+   ATT_FROM,
+   ATT_GROUP,
+   ATT_GROUPBY,
+   ATT_HAVING,
+   ATT_HREF,
+   ATT_JSARRAY,
+   ATT_JSARRAYHEAD,
+   ATT_JSON,
+   ATT_KELVIN,
+   ATT_KEY,
+   ATT_LIMIT,
+   ATT_MATCH,
+   ATT_MAXLENGTH,
+   ATT_MEMO,
+   ATT_MISSING,
+   ATT_MULTIPLE,
+   ATT_NAME,
+   ATT_OBJECT,
+   ATT_ORDER,
+   ATT_ORDERBY,
+   ATT_PATH,
+   ATT_QUERY,
+   ATT_REPLACE,
+   ATT_RIGHT,
+   ATT_SELECT,
+   ATT_SET,
+   ATT_SIZE,
+   ATT_SRC,
+   ATT_STREAM,
+   ATT_STYLE,
+   ATT_TABLE,
+   ATT_TABLEHEAD,
+   ATT_TABLEROW,
+   ATT_TARGET,
+   ATT_TITLE,
+   ATT_TRIM,
+   ATT_TTL,
+   ATT_TYPE,
+   ATT_VALUE,
+   ATT_VAR,
+   ATT_WHERE,
+   ATT_XML,
+   ATT_MAX                      // no more than 64
+};
+
 // Misc
-xmltoken *loadfile (char *fn);
+xmltoken *loadfile (char *fn, char **bufp, size_t *maplenp, xmlarena * arena);
+xmltoken *loadtemplate (char *fn);
+void tagcode (xmltoken * x, xmlarena * arena);
+void attindex (xmltoken * x, xmlarena * arena);
 
 char *
 eval (char *e)
@@ -346,292 +647,1544 @@ fieldlen (MYSQL_FIELD * f)
    return f->length;
 }
 
+static inline uint32_t
+namehash (const char *n)
+{                               // FNV-1a
+   uint32_t h = 2166136261U;
+   while (*n)
+      h = (h ^ (unsigned char) *n++) * 16777619U;
+   return h;
+}
+
+// Our set variables, hashed, shadowing the environment, which is looked up directly for names we have not set
+typedef struct
+{
+   char *name;                  // NULL for empty slot
+   char *value;                 // NULL if unset, hiding any environment variable
+   uint32_t hash;
+} var_t;
+var_t *vars = NULL;
+unsigned int varsize = 0,       // power of 2
+   varcount = 0;
+// Saved values for scoped variables, e.g. FOR
+typedef struct
+{
+   char *name;
+   char *value;
+} varsave_t;
+varsave_t *varsaved = NULL;
+unsigned int varsaves = 0,
+   varsavemax = 0;
+
+static var_t *
+varslot (const char *n, uint32_t h)
+{                               // slot for variable, empty slot if not set
+   unsigned int s = (h & (varsize - 1));
+   while (vars[s].name && (vars[s].hash != h || strcmp (vars[s].name, n)))
+      s = ((s + 1) & (varsize - 1));
+   return &vars[s];
+}
+
+var_t *
+varfind (const char *n)
+{                               // find variable we have set, NULL if not
+   if (!varsize)
+      return NULL;
+   var_t *v = varslot (n, namehash (n));
+   return v->name ? v : NULL;
+}
+
 char *
-getvar (const char *n, int *lenp, int *levelp, int *fieldp)
-{                               // Return a variable content
-   if (levelp)
-      *levelp = -1;
-   if (fieldp)
-      *fieldp = -1;
-   int l = level;
-   if (lenp)
-      *lenp = 0;
-   if (!n)
-      return 0;
-   if (*n == '$')
-      n = getvar (n + 1, NULL, levelp, fieldp); // Nested get, e.g. ${$X}
-   // check SQL
-   while (l)
+varget (const char *n)
+{                               // get variable, NULL if not set
+   var_t *var = varfind (n);
+   if (var)
+      return var->value;
+   return getenv (n);
+}
+
+void
+varset (const char *n, const char *v)
+{                               // set variable, NULL to unset
+   uint32_t h = namehash (n);
+   if ((varcount + 1) * 2 > varsize)
+   {                            // grow
+      unsigned int oldsize = varsize,
+         s;
+      var_t *old = vars;
+      varsize = (varsize ? varsize * 2 : 256);
+      vars = calloc (varsize, sizeof (*vars));
+      if (!vars)
+         errx (1, "malloc at line %d", __LINE__);
+      for (s = 0; s < oldsize; s++)
+         if (old[s].name)
+            *varslot (old[s].name, old[s].hash) = old[s];
+      free (old);
+   }
+   var_t *var = varslot (n, h);
+   if (!var->name)
    {
-      int f,
-        max;
-      l--;
-      max = fields[l];
-      if (sqlactive[l])
-         for (f = 0; f < max; f++)
-            if (!strcmp (field[l][f].name, n))  // TODO - what of database.field
-            {
-               char *v = NULL;
-               if (lenp)
-                  *lenp = fieldlen (&field[l][f]);
-               if (sqlactive[l] == 2)
-               {
-                  v = getenv (n);
-                  if (!v)
-                     v = field[l][f].def;
-               } else if (row[l][f])
-                  v = (char *) row[l][f];
-               if (v && !strncmp (v, "0000", 4)
-                   && (field[l][f].type == FIELD_TYPE_DATE || field[l][f].type == FIELD_TYPE_DATETIME
-                       || field[l][f].type == FIELD_TYPE_TIMESTAMP))
-                  v = "";
-               if (levelp)
-                  *levelp = l;
-               if (fieldp)
-                  *fieldp = f;
-               return v;
-            }
+      if (!(var->name = strdup (n)))
+         errx (1, "malloc at line %d", __LINE__);
+      var->value = NULL;
+      var->hash = h;
+      varcount++;
    }
-   // last resort, environment
-   return getenv (n);
+   char *was = var->value;
+   var->value = NULL;
+   if (v && !(var->value = strdup (v)))
+      errx (1, "malloc at line %d", __LINE__);
+   free (was);
 }
 
-char *
-getvarexpand (const char *n)
-{
-   return getvar (n, NULL, NULL, NULL);
+#define varunset(n) varset(n,NULL)
+
+int
+varscope (void)
+{                               // start scope, returns mark for varscopeend
+   return varsaves;
 }
 
+void
+varlocal (const char *n)
+{                               // variable to be restored at end of scope
+   if (varsaves == varsavemax)
+   {
+      varsavemax += 16;
+      varsaved = realloc (varsaved, varsavemax * sizeof (*varsaved));
+      if (!varsaved)
+         errx (1, "malloc at line %d", __LINE__);
+   }
+   char *v = varget (n);
+   varsaved[varsaves].name = strdup (n);
+   varsaved[varsaves].value = (v ? strdup (v) : NULL);
+   varsaves++;
+}
 
-char *
-expandd (char *buf, int len, const char *i, char sum)
-{                               // expand a string (sum set if allow variables without $ and default variables to zero, for maths in eval, etc)
-   char *o = buf,
-      *x = buf + len - 1;
-   if (!i)
-      return NULL;
+void
+varscopeend (int mark)
+{                               // restore variables saved since mark
+   while (varsaves > mark)
    {
-// Does it need expanding?
-      const char *p = i;
-      while (*p)
+      varsaves--;
+      varset (varsaved[varsaves].name, varsaved[varsaves].value);
+      free (varsaved[varsaves].name);
+      free (varsaved[varsaves].value);
+   }
+}
+
+void
+varexport (void)
+{                               // copy variables we have set to environment, for EXEC
+   unsigned int s;
+   for (s = 0; s < varsize; s++)
+      if (vars[s].name)
       {
-         if ((*p == '$' && (isalpha (p[1]) || strchr (SQLEXPANDPREFIX, p[1])))
-#ifndef  BODGEEVAL
-             || (sum && isalpha (*p) && (p == i || !isalnum (p[-1])))
-#endif
-            )
-            break;
-         if (*p == '\\' && p[1])
-         {
-            p += 2;
-            continue;
-         }
-         p++;
+         if (vars[s].value)
+            setenv (vars[s].name, vars[s].value, 1);
+         else
+            unsetenv (vars[s].name);
       }
-      if (!*p)
-         return (char *) i;     // Unchanged 
+}
+
+void
+varclear (void)
+{                               // forget all variables, e.g. new SCGI request
+   varscopeend (0);
+   unsigned int s;
+   for (s = 0; s < varsize; s++)
+      if (vars[s].name)
+      {
+         free (vars[s].name);
+         free (vars[s].value);
+         vars[s].name = NULL;
+      }
+   varcount = 0;
+}
+
+void
+fieldindex (int l)
+{                               // make field name hash for level, call when field[l] and fields[l] set
+   unsigned int size = 8;
+   while (size < fields[l] * 2)
+      size <<= 1;
+   if (size > fieldhashsize[l])
+   {
+      free (fieldhash[l]);
+      fieldhash[l] = malloc (size * sizeof (*fieldhash[l]));
+      free (fielddate[l]);
+      fielddate[l] = malloc (size / 2);
+      if (!fieldhash[l] || !fielddate[l])
+         errx (1, "malloc at line %d", __LINE__);
+      fieldhashsize[l] = size;
    }
-   char q = 0;
-   // Expand
-#ifndef  BODGEEVAL
-   char *base = i;
-#endif
-   while (*i && o < x)
+   memset (fieldhash[l], 0, fieldhashsize[l] * sizeof (*fieldhash[l]));
+   int f;
+   for (f = 0; f < fields[l]; f++)
    {
-      if ((*i == '$' && (isalpha (i[1]) || strchr (SQLEXPANDPREFIX, i[1])))
-#ifndef  BODGEEVAL
-          || (sum && isalpha (*i) && (i == base || !isalnum (i[-1])))
-#endif
-         )
-      {
-         const char *e;
-         dollar_expand_t *d = NULL;
-         char *fail (const char *e)
-         {
-            warnx ("Expand failed: %s\n[%s]", e, i);
-            dollar_expand_free (&d);
-            return NULL;
-         }
-         if (*i == '$')
-            i++;
-         d = dollar_expand_parse (&i, &e);
-         if (!d)
-            return fail (e);
-         if (e)
-            warnx ("Expand: %s\n[%s]", e, i);
-         const char *name = dollar_expand_name (d);
-         if (!name)
-            warnx ("Unexpected no name: %s", i);
-         else if (!strcmp (name, "$"))
+      fielddate[l][f] = (field[l][f].type == FIELD_TYPE_DATE || field[l][f].type == FIELD_TYPE_DATETIME
+                         || field[l][f].type == FIELD_TYPE_TIMESTAMP);
+      uint32_t h = namehash (field[l][f].name);
+      unsigned int s = (h & (fieldhashsize[l] - 1));
+      while (fieldhash[l][s].f
+             && (fieldhash[l][s].hash != h || strcmp (field[l][fieldhash[l][s].f - 1].name, field[l][f].name)))
+         s = ((s + 1) & (fieldhashsize[l] - 1));
+      if (fieldhash[l][s].f)
+         continue;              // duplicate, first is used
+      fieldhash[l][s].hash = h;
+      fieldhash[l][s].f = f + 1;
+   }
+}
+
+SQL *
+sqlconn (void)
+{                               // connection for the next query, connected when first needed
+   int n = sqlstreams;          // no more than levels, so always < MAXLEVEL
+   if (!sqlconnected[n])
+   {
+      sql_real_connect (&sql[n], sqlhost, sqluser, sqlpass, sqldatabase, sqlport, 0, 0, 1, sqlconf);
+      sqlconnected[n] = 1;
+   }
+   return &sql[n];
+}
+
+static void
+sqlprepdel (sqlprep_t * p)
+{
+   if (p->stmt)
+      mysql_stmt_close (p->stmt);
+   unsigned int c;
+   for (c = 0; c < p->cols; c++)
+      free (p->bind[c].buffer);
+   free (p->bind);
+   free (p->len);
+   free (p->null);
+   free (p->row);
+   free (p->param);
+   free (p->query);
+   free (p);
+   sqlpreps--;
+}
+
+static int
+sqlprepinuse (sqlprep_t * p)
+{                               // statement has a result being read
+   int l;
+   for (l = 0; l < MAXLEVEL; l++)
+      if (sqlprepres[l] == p)
+         return 1;
+   return 0;
+}
+
+void
+sqlprepforget (xmlarena * a, int conn)
+{                               // drop prepared statements for tokens in arena a, or if a is NULL, for connection conn (-1 for all not in use)
+   int h;
+   for (h = 0; h < SQLPREPHASH; h++)
+   {
+      sqlprep_t **pp = &sqlprephash[h],
+         *p;
+      while ((p = *pp))
+         if (a ? xmlarenaowns (a, p->x) : conn < 0 ? !sqlprepinuse (p) : p->conn == conn)
          {
-            o += sprintf (o, "%d", getppid ());
-            continue;
-         } else if (!name[1] && *name == '@')
-         {                      // Cache feature id
-            struct stat s = { };
-            time_t when = 0;
-            if (!stat (".", &s))
-               when = s.st_mtime;
-            else
-               when = time (0);
-            o += sprintf (o, "%ld", when);
+            *pp = p->next;
+            sqlprepdel (p);
          } else
-         {
-            //char literal = dollar_expand_literal(d); // TODO use to control safe expansion...
-            char query = dollar_expand_query (d);
-            char *v = getvar (name, NULL, NULL, NULL);
-            if (!v && query)
-            {
-               dollar_expand_free (&d);
-               return NULL;     // expand fails as variable does not exist
-            }
-            if ((!v || !*v) && sum)
-               v = "0";
+            pp = &p->next;
+   }
+}
 
-            if (v && !query)
-            {
-               v = dollar_expand_process (d, v, &e, 0);
-               if (e)
-                  warnx ("Expand: %s\n[%s]", e, i);
-               if (v)
-               {
-                  char safe = dollar_expand_underscore (d);
-                  char list = dollar_expand_list (d);
-                  char quote = dollar_expand_quote (d);
-                  if (q)
-                     quote = 0;
-                  else if (quote)
-                  {
-                     if (o < x)
-                        *o++ = (q = '"');
-                  }
-                  if (safe)
-                  {
-                     while (*v && o < x)
-                     {
-                        if (*v == '\'' || *v == '"')
-                           *o = '_';
-                        else
-                           *o = *v;
-                        o++;
-                        v++;
-                     }
-                  } else if (q)
-                  {
-                     while (*v && o < x)
-                     {
-                        if (list && (*v == '\t' || *v == ','))
-                        {       // List comma
-                           if (q && o < x)
-                              *o++ = q;
-                           if (o < x)
-                              *o++ = ',';
-                           if (q && o < x)
-                              *o++ = q;
-                        } else
-                        {
-                           if (q && *v == q && o < x)
-                              *o++ = *v;
-                           if (o < x)
-                              *o++ = *v;
-                        }
-                        v++;
-                     }
-                  } else
-                     while (*v && o < x)
-                        *o++ = *v++;    // simple expansion
-                  if (quote)
-                  {
-                     if (o < x)
-                        *o++ = q;
-                     q = 0;
-                  }
-               }
-            }
+static void
+sqlstatforget (xmlarena * a)
+{                               // detach SQL timing from tokens in arena a, so a token later at the same address is not merged with it
+   int h;
+   sqlstat_t *st;
+   for (h = 0; h < SQLSTATHASH; h++)
+      for (st = sqlstathash[h]; st; st = st->next)
+         if (st->x && xmlarenaowns (a, st->x))
+            st->x = NULL;
+}
+
+void
+arenafree (xmlarena * a)
+{                               // free a parsed script, and any statements prepared or timing for its tokens
+   if (sqlpreps)
+      sqlprepforget (a, 0);
+   if (sqlstatcount)
+      sqlstatforget (a);
+   xmlarenafree (a);
+}
+
+void
+sqlreset (void)
+{                               // reset kept connections for a new SCGI request, as if new, or close them if that fails
+   int n;
+   for (n = 0; n < MAXLEVEL; n++)
+      if (sqlconnected[n])
+      {                         // transactions, locks, variables, temporary tables and prepared statements go
+         sqlprepforget (NULL, n);
+         if (mysql_reset_connection (&sql[n]) || (sqldatabase && mysql_select_db (&sql[n], sqldatabase)))
+         {
+            sql_close (&sql[n]);
+            sqlconnected[n] = 0;
          }
-         dollar_expand_free (&d);
-      } else if (*i == '\\' && i[1])
+      }
+   for (n = 0; n < SQLPARALLELMAX; n++)
+      if (sqlparconnected[n]
+          && (mysql_reset_connection (&sqlpar[n]) || (sqldatabase && mysql_select_db (&sqlpar[n], sqldatabase))))
       {
-         *o++ = *i++;
-         *o++ = *i++;
-      } else                    // normal character
+         sql_close (&sqlpar[n]);
+         sqlparconnected[n] = 0;
+      }
+}
+
+void
+sqlclose (int ping)
+{                               // close connections, or only those that do not answer a ping
+   int n;
+   for (n = 0; n < MAXLEVEL; n++)
+      if (sqlconnected[n] && (!ping || mysql_ping (&sql[n])))
       {
-         if (q && *i == q)
-            q = 0;
-         else if (*i == '\'' || *i == '"' || *i == '`')
-            q = *i;
-         *o++ = *i++;
+         sqlprepforget (NULL, n);
+         sql_close (&sql[n]);
+         sqlconnected[n] = 0;
+      }
+   for (n = 0; n < SQLPARALLELMAX; n++)
+      if (sqlparconnected[n] && (!ping || mysql_ping (&sqlpar[n])))
+      {
+         sql_close (&sqlpar[n]);
+         sqlparconnected[n] = 0;
       }
-   }
-   *o = 0;
-   xmlutf8 (buf);
-   return buf;
 }
 
-char *
-expand (char *buf, int len, char *i)
+static void
+sqlmemodel (sqlmemo_t * m)
 {
-   return expandd (buf, len, i, 0);
+   sql_free_result (m->res);
+   free (m->query);
+   free (m);
 }
 
-char *
-expandz (char *buf, int len, char *i)
-{
-   return expandd (buf, len, i, 1);
+static int
+sqlmemoinuse (sqlmemo_t * m)
+{                               // memo result is being read
+   int l;
+   for (l = 0; l < MAXLEVEL; l++)
+      if (sqlmemores[l] == m)
+         return 1;
+   return 0;
 }
 
-static void
-xputc (unsigned char c, FILE * f, int flags)
+void
+sqlmemoflush (void)
+{                               // drop all memo results, e.g. after a change
+   int h;
+   for (h = 0; h < SQLMEMOHASH; h++)
+      while (sqlmemohash[h])
+      {
+         sqlmemo_t *m = sqlmemohash[h];
+         sqlmemohash[h] = m->next;
+         if (sqlmemoinuse (m))
+            m->dropped = 1;
+         else
+            sqlmemodel (m);
+      }
+   sqlmemobytes = 0;
+}
+
+static sqlmemo_t *
+sqlmemofind (const char *query)
 {
-   if (flags & FLAG_XML)
+   uint32_t h = namehash (query);
+   sqlmemo_t *m;
+   for (m = sqlmemohash[h % SQLMEMOHASH]; m && (m->hash != h || strcmp (m->query, query)); m = m->next);
+   return m;
+}
+
+static sqlmemo_t *
+sqlmemoadd (char *query, SQL_RES * r)
+{                               // keep a result, NULL if too big
+   size_t bytes = strlen (query) + sizeof (sqlmemo_t);
+   SQL_FIELD *f = sql_fetch_field (r);
+   unsigned int n = sql_num_fields (r),
+      c;
+   for (c = 0; c < n; c++)
+      bytes += mysql_num_rows (r) * (f[c].max_length + sizeof (char *) + 1);
+   if (sqlmemobytes + bytes > SQLMEMOMAX)
+      return NULL;
+   sqlmemo_t *m = calloc (1, sizeof (*m));
+   if (!m || !(m->query = strdup (query)))
+      errx (1, "malloc at line %d", __LINE__);
+   m->hash = namehash (query);
+   m->res = r;
+   m->bytes = bytes;
+   m->next = sqlmemohash[m->hash % SQLMEMOHASH];
+   sqlmemohash[m->hash % SQLMEMOHASH] = m;
+   sqlmemobytes += bytes;
+   return m;
+}
+
+void
+sqlmemodone (void)
+{                               // end of run
+   if (debug && (sqlmemohits || sqlmemomisses))
+      warnx ("SQL memo: %d hit%s, %d miss%s, %lu bytes", sqlmemohits, sqlmemohits == 1 ? "" : "s", sqlmemomisses,
+             sqlmemomisses == 1 ? "" : "es", (unsigned long) sqlmemobytes);
+   sqlmemoflush ();
+   sqlmemohits = sqlmemomisses = 0;
+}
+
+static char *
+cachepath (const char *key, size_t len, const char *ext)
+{                               // malloced path of file in --cache-dir
+   unsigned char hash[SHA_DIGEST_LENGTH];
+   SHA1 ((unsigned char *) key, len, hash);
+   char *path = NULL;
+   if (asprintf (&path, "%s/%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x.%s", cachedir,
+                 hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7], hash[8], hash[9], hash[10], hash[11],
+                 hash[12], hash[13], hash[14], hash[15], hash[16], hash[17], hash[18], hash[19], ext) < 0)
+      errx (1, "malloc at line %d", __LINE__);
+   return path;
+}
+
+static char *
+sqlcachepath (const char *query)
+{                               // malloced path of cache file for query
+   char *key = NULL;
+   int l = asprintf (&key, "%s%c%s%c%s", sqlhost ? : "", 0, sqldatabase ? : "", 0, query);
+   if (l < 0)
+      errx (1, "malloc at line %d", __LINE__);
+   char *path = cachepath (key, l, "xmlsqlc");
+   free (key);
+   return path;
+}
+
+static sqlcache_t *
+sqlcacheload (const char *query)
+{                               // cached result for query, NULL if none or expired
+   char *path = sqlcachepath (query);
+   int f = open (path, O_RDONLY);
+   free (path);
+   if (f < 0)
+      return NULL;
+   struct stat s;
+   sqlcachehead_t *h = MAP_FAILED;
+   if (!fstat (f, &s) && s.st_size >= sizeof (*h))
+      h = mmap (NULL, s.st_size, PROT_READ, MAP_SHARED, f, 0); // replaced by rename, never changed in place
+   close (f);
+   if (h == MAP_FAILED)
+      return NULL;
+   size_t cells = (size_t) h->rows * h->fields;
+   sqlcachefield_t *cf = (void *) (h + 1);
+   uint32_t *cc = (void *) (cf + h->fields);
+   char *buf = (void *) (cc + cells);
+   if (memcmp (h->magic, SQLCACHEMAGIC, sizeof (h->magic)) || h->expires <= time (0) || !h->fields || !h->buflen
+       || sizeof (*h) + (uint64_t) h->fields * sizeof (*cf) + (uint64_t) cells * sizeof (*cc) + h->buflen > (uint64_t) s.st_size
+       || buf[h->buflen - 1] || h->query >= h->buflen || strcmp (buf + h->query, query))
+   {                            // expired, not valid, or another query with the same hash
+      munmap (h, s.st_size);
+      return NULL;
+   }
+   char *str (uint32_t o)
    {
-      if (c == '<')
-         fprintf (f, "%s", "&lt;");
-      else if (c == '>')
-         fprintf (f, "%s", "&gt;");
-      else if (c == '&' && !(flags & FLAG_MARKUP))
-         fprintf (f, "%s", "&amp;");
-      else if (c < ' ')
-         fprintf (f, "&#%u;", c);
-      else
-         fputc (c, f);
-   } else if (flags & FLAG_JSON)
-   {
-      if (c == '"')
-         fprintf (f, "%s", "\\\"");
-      else if (c == '\\')
-         fprintf (f, "%s", "\\\\");
-      else if (c == '\r')
-         fprintf (f, "%s", "\\r");
-      else if (c == '\n')
-         fprintf (f, "%s", "\\n");
-      else if (c == '\t')
-         fprintf (f, "%s", "\\t");
-      else if (c == '/')
-         fprintf (f, "%s", "\\/");
-      else
-         fputc (c, f);
+      if (o >= h->buflen)
+         return NULL;
+      return buf + o;
    }
-
-   else
-      fputc (c, f);
+   sqlcache_t *c = calloc (1, sizeof (*c));
+   if (!c || !(c->field = calloc (h->fields, sizeof (*c->field))) || !(c->cell = malloc ((cells ? : 1) * sizeof (*c->cell))))
+      errx (1, "malloc at line %d", __LINE__);
+   c->map = h;
+   c->maplen = s.st_size;
+   c->fields = h->fields;
+   c->rows = h->rows;
+   unsigned int n;
+   for (n = 0; n < c->fields; n++)
+   {
+      SQL_FIELD *f = &c->field[n];
+      f->name = str (cf[n].name) ? : "";
+      f->org_name = str (cf[n].org_name);
+      f->table = str (cf[n].table);
+      f->org_table = str (cf[n].org_table);
+      f->db = str (cf[n].db);
+      f->type = cf[n].type;
+      f->flags = cf[n].flags;
+      f->decimals = cf[n].decimals;
+      f->charsetnr = cf[n].charsetnr;
+      f->length = cf[n].length;
+      f->max_length = cf[n].max_length;
+   }
+   size_t i;
+   for (i = 0; i < cells; i++)
+      c->cell[i] = str (cc[i]);
+   return c;
 }
 
-static inline void
-xputs (char *s, FILE * f, int flags)
+static void
+sqlcachefree (sqlcache_t * c)
 {
-   while (*s)
-      xputc (*s++, f, flags);
+   munmap (c->map, c->maplen);
+   free (c->field);
+   free (c->cell);
+   free (c);
 }
 
-// alternative writeattr for tagwrite to use.
 static void
-expandwriteattr (FILE * f, char *tag, char *value)
-{
-   if (tag)
+sqlcachesave (const char *query, SQL_RES * r, int ttl)
+{                               // write result to the cache, leaving r at the first row
+   unsigned int fields = sql_num_fields (r),
+      rows = mysql_num_rows (r),
+      n;
+   SQL_FIELD *f = sql_fetch_field (r);
+   sqlcachehead_t h = {.expires = time (0) + ttl,.fields = fields,.rows = rows };
+   memcpy (h.magic, SQLCACHEMAGIC, sizeof (h.magic));
+   sqlcachefield_t *cf = calloc (fields ? : 1, sizeof (*cf));
+   uint32_t *cc = malloc (((size_t) rows * fields ? : 1) * sizeof (*cc));
+   if (!cf || !cc)
+      errx (1, "malloc at line %d", __LINE__);
+   char *buf = NULL;
+   size_t buflen = 0;
+   FILE *b = open_memstream (&buf, &buflen);
+   uint32_t str (const char *p)
    {
-      if (!value)
-         fprintf (f, " %s", tag);
+      if (!p)
+         return SQLCACHENONE;
+      uint32_t o = ftell (b);
+      fwrite (p, 1, strlen (p) + 1, b);
+      return o;
+   }
+   h.query = str (query);
+   for (n = 0; n < fields; n++)
+   {
+      cf[n].name = str (f[n].name);
+      cf[n].org_name = str (f[n].org_name);
+      cf[n].table = str (f[n].table);
+      cf[n].org_table = str (f[n].org_table);
+      cf[n].db = str (f[n].db);
+      cf[n].type = f[n].type;
+      cf[n].flags = f[n].flags;
+      cf[n].decimals = f[n].decimals;
+      cf[n].charsetnr = f[n].charsetnr;
+      cf[n].length = f[n].length;
+      cf[n].max_length = f[n].max_length;
+   }
+   SQL_ROW row;
+   uint32_t *c = cc;
+   while ((row = sql_fetch_row (r)) && c < cc + (size_t) rows * fields)
+      for (n = 0; n < fields; n++)
+         *c++ = str (row[n]);
+   mysql_data_seek (r, 0);
+   fclose (b);
+   h.buflen = buflen;
+   if (c == cc + (size_t) rows * fields && buflen < SQLCACHENONE)
+   {                            // write to temporary file and rename, so readers never see a partial file
+      char *path = sqlcachepath (query),
+         *temp = NULL;
+      if (asprintf (&temp, "%s/.xmlsqlcXXXXXX", cachedir) < 0)
+         errx (1, "malloc at line %d", __LINE__);
+      int fd = mkstemp (temp);
+      if (fd < 0)
+         warn ("SQL cache [%s]", temp);
+      else
+      {
+         FILE *o = fdopen (fd, "w");
+         if (!o)
+         {
+            warn ("SQL cache [%s]", temp);
+            close (fd);
+            unlink (temp);
+         } else
+         {
+            fchmod (fd, 0644);
+            int e = (fwrite (&h, sizeof (h), 1, o) != 1 || fwrite (cf, sizeof (*cf), fields, o) != fields
+                     || fwrite (cc, sizeof (*cc), (size_t) rows * fields, o) != (size_t) rows * fields
+                     || fwrite (buf, 1, buflen, o) != buflen);
+            if (fclose (o) || e || rename (temp, path))
+            {
+               warn ("SQL cache [%s]", path);
+               unlink (temp);
+            }
+         }
+      }
+      free (temp);
+      free (path);
+   }
+   free (buf);
+   free (cf);
+   free (cc);
+}
+
+static schema_t *
+schemafind (const char *db, const char *table, const char *column)
+{                               // schema cache entry, empty if new or expired, NULL if not caching
+   if (schemattl <= 0)
+      return NULL;
+   char *key = NULL;
+   int len = asprintf (&key, "%s%c%s%c%s", db ? : "", 0, table ? : "", 0, column ? : "");
+   if (len < 0)
+      errx (1, "malloc at line %d", __LINE__);
+   uint32_t h = 0;
+   int n;
+   for (n = 0; n < len; n++)
+      h = h * 31 + (unsigned char) key[n];
+   schema_t *c;
+   for (c = schemahash[h % SCHEMAHASH]; c && (c->keylen != len || memcmp (c->key, key, len)); c = c->next);
+   time_t now = time (0);
+   if (c)
+   {
+      free (key);
+      if (c->when + schemattl > now)
+         return c;
+      int l;
+      for (l = 0; l < MAXLEVEL && schemares[l] != c; l++);
+      if (l < MAXLEVEL)
+         return NULL;           // expired, but in use
+      if (c->res)
+         sql_free_result (c->res);
+      c->res = NULL;
+      free (c->type);
+      c->type = NULL;
+      c->when = now;
+      return c;
+   }
+   if (!(c = calloc (1, sizeof (*c))))
+      errx (1, "malloc at line %d", __LINE__);
+   c->key = key;
+   c->keylen = len;
+   c->when = now;
+   c->next = schemahash[h % SCHEMAHASH];
+   schemahash[h % SCHEMAHASH] = c;
+   return c;
+}
+
+void
+sqlfree (int l)
+{                               // free result for level, ending the STREAM if it is one
+   sqlbatch_t *b;
+   while ((b = sqlbatches[l]))
+   {                            // batches for SQL nested in this level
+      sqlbatches[l] = b->next;
+      int r;
+      for (r = 0; r < b->results; r++)
+         sql_free_result (b->res[r]);
+      xmlarenafree (b->arena);
+   }
+   sqlrows[l] = 0;
+   if (sqlbatchres[l])
+   {                            // res is the batch's first result
+      sqlbatchres[l] = NULL;
+      res[l] = NULL;
+   }
+   if (sqlcacheres[l])
+   {
+      sqlcachefree (sqlcacheres[l]);
+      sqlcacheres[l] = NULL;
+   }
+   if (sqlmemores[l])
+   {                            // res is kept in the memo
+      if (sqlmemores[l]->dropped)
+         sqlmemodel (sqlmemores[l]);
+      sqlmemores[l] = NULL;
+      res[l] = NULL;
+   }
+   if (schemares[l])
+   {                            // res is kept in the schema cache
+      schemares[l] = NULL;
+      res[l] = NULL;
+   }
+   if (sqlprepres[l])
+   {                            // res is the statement's field list
+      mysql_stmt_free_result (sqlprepres[l]->stmt);
+      sqlprepres[l] = NULL;
+   }
+   sql_free_result (res[l]);
+   res[l] = NULL;
+   if (sqlstream[l])
+   {
+      sqlstream[l] = 0;
+      sqlstreams--;
+   }
+}
+
+SQL_ROW
+sqlfetch (int l)
+{                               // next row for level
+   sqlcache_t *k = sqlcacheres[l];
+   if (k)
+   {
+      if (k->pos >= k->rows)
+         return NULL;
+      sqlrows[l]++;
+      return k->cell + (size_t) k->fields * k->pos++;
+   }
+   sqlbatch_t *b = sqlbatchres[l];
+   if (b)
+   {
+      if (!b->pos)
+         return NULL;
+      SQL_ROW r = b->pos->row;
+      b->pos = b->pos->next;
+      sqlrows[l]++;
+      return r;
+   }
+   sqlprep_t *p = sqlprepres[l];
+   if (!p)
+   {
+      SQL_ROW r = sql_fetch_row (res[l]);
+      if (r)
+         sqlrows[l]++;
+      return r;
+   }
+   int r = mysql_stmt_fetch (p->stmt);
+   if (r == MYSQL_DATA_TRUNCATED)
+   {                            // make buffers bigger
+      unsigned int c;
+      for (c = 0; c < p->cols; c++)
+         if (!p->null[c] && p->len[c] > p->bind[c].buffer_length)
+         {
+            p->bind[c].buffer = realloc (p->bind[c].buffer, p->len[c] + 1);
+            if (!p->bind[c].buffer)
+               errx (1, "malloc at line %d", __LINE__);
+            p->bind[c].buffer_length = p->len[c];
+            mysql_stmt_fetch_column (p->stmt, &p->bind[c], c, 0);
+         }
+      mysql_stmt_bind_result (p->stmt, p->bind);
+   } else if (r)
+      return NULL;
+   sqlrows[l]++;
+   unsigned int c;
+   for (c = 0; c < p->cols; c++)
+      if (p->null[c])
+         p->row[c] = NULL;
+      else
+      {
+         p->row[c] = p->bind[c].buffer;
+         p->row[c][p->len[c]] = 0;
+      }
+   return p->row;
+}
+
+char *
+getvar (const char *n, int *lenp, int *levelp, int *fieldp)
+{                               // Return a variable content
+   if (levelp)
+      *levelp = -1;
+   if (fieldp)
+      *fieldp = -1;
+   int l = level;
+   if (lenp)
+      *lenp = 0;
+   if (!n)
+      return 0;
+   if (*n == '$')
+      n = getvar (n + 1, NULL, levelp, fieldp); // Nested get, e.g. ${$X}
+   if (!n)
+      return 0;
+   // check SQL
+   uint32_t h = 0;
+   if (l)
+      h = namehash (n);
+   while (l)
+   {
+      int f;
+      l--;
+      if (sqlactive[l])
+      {
+         unsigned int s = (h & (fieldhashsize[l] - 1));
+         while ((f = fieldhash[l][s].f) && (fieldhash[l][s].hash != h || strcmp (field[l][f - 1].name, n)))     // TODO - what of database.field
+            s = ((s + 1) & (fieldhashsize[l] - 1));
+         if (f--)
+         {
+            char *v = NULL;
+            if (lenp)
+               *lenp = fieldlen (&field[l][f]);
+            if (sqlactive[l] == 2)
+            {
+               v = varget (n);
+               if (!v)
+                  v = field[l][f].def;
+            } else if (row[l][f])
+               v = (char *) row[l][f];
+            if (v && fielddate[l][f] && !strncmp (v, "0000", 4))
+               v = "";
+            if (levelp)
+               *levelp = l;
+            if (fieldp)
+               *fieldp = f;
+            return v;
+         }
+      }
+   }
+   // our variables, and the environment
+   return varget (n);
+}
+
+char *
+getvarexpand (const char *n)
+{
+   return getvar (n, NULL, NULL, NULL);
+}
+
+
+// Growable buffer for expansion, taken from a pool of free buffers so nested expansion does not allocate every time
+#define	TEMPPOOL	32      // free buffers kept
+#define	TEMPKEEP	1048576 // largest buffer kept
+typedef struct
+{
+   char *buf;
+   size_t size;
+} temp_t;
+#define	TEMP(n)	temp_t n __attribute__((cleanup(tempdone))) = { }
+static temp_t temppool[TEMPPOOL];
+static int temppools = 0;
+
+static void
+tempdone (temp_t * t)
+{                               // return buffer to pool
+   if (!t->buf)
+      return;
+   if (temppools < TEMPPOOL && t->size <= TEMPKEEP)
+      temppool[temppools++] = *t;
+   else
+      free (t->buf);
+   t->buf = NULL;
+   t->size = 0;
+}
+
+static char *
+tempneed (temp_t * t, size_t n)
+{                               // make sure buffer is at least n bytes
+   if (!t->buf && temppools)
+      *t = temppool[--temppools];
+   if (n <= t->size)
+      return t->buf;
+   size_t s = t->size ? : 256;
+   while (s < n)
+      s *= 2;
+   t->buf = realloc (t->buf, s);
+   if (!t->buf)
+      errx (1, "malloc at line %d", __LINE__);
+   t->size = s;
+   return t->buf;
+}
+
+static inline void
+tempputc (temp_t * t, size_t * o, char c)
+{
+   if (*o + 1 >= t->size)
+      tempneed (t, *o + 2);
+   t->buf[(*o)++] = c;
+}
+
+static inline void
+tempputs (temp_t * t, size_t * o, const char *s, size_t l)
+{
+   if (*o + l >= t->size)
+      tempneed (t, *o + l + 1);
+   memcpy (t->buf + *o, s, l);
+   *o += l;
+}
+
+static char *
+tempend (temp_t * t, size_t o)
+{                               // terminate and fix UTF-8
+   tempneed (t, o + 1)[o] = 0;
+   xmlutf8 (t->buf);
+   return t->buf;
+}
+
+static int
+expandref (const char **ip, temp_t * t, size_t * op, char *qp, char sum)
+{                               // expand a $ reference (or name if sum) at *ip in to t at *op, tracking quote *qp, -1 if expand fails
+   const char *i = *ip;
+   char q = *qp;
+   const char *e;
+   dollar_expand_t *d = NULL;
+   int fail (const char *e)
+   {
+      warnx ("Expand failed: %s\n[%s]", e, i);
+      dollar_expand_free (&d);
+      return -1;
+   }
+   if (*i == '$')
+      i++;
+   d = dollar_expand_parse (&i, &e);
+   if (!d)
+      return fail (e);
+   if (e)
+      warnx ("Expand: %s\n[%s]", e, i);
+   const char *name = dollar_expand_name (d);
+   if (!name)
+      warnx ("Unexpected no name: %s", i);
+   else if (!strcmp (name, "$"))
+   {
+      char n[24];
+      tempputs (t, op, n, sprintf (n, "%d", getppid ()));
+   } else if (!name[1] && *name == '@')
+   {                            // Cache feature id
+      struct stat s = { };
+      time_t when = 0;
+      if (!stat (".", &s))
+         when = s.st_mtime;
+      else
+         when = time (0);
+      char n[24];
+      tempputs (t, op, n, sprintf (n, "%ld", when));
+   } else
+   {
+      //char literal = dollar_expand_literal(d); // TODO use to control safe expansion...
+      char query = dollar_expand_query (d);
+      char *v = getvar (name, NULL, NULL, NULL);
+      if (!v && query)
+      {
+         dollar_expand_free (&d);
+         return -1;             // expand fails as variable does not exist
+      }
+      if ((!v || !*v) && sum)
+         v = "0";
+
+      if (v && !query)
+      {
+         v = dollar_expand_process (d, v, &e, 0);
+         if (e)
+            warnx ("Expand: %s\n[%s]", e, i);
+         if (v)
+         {
+            char safe = dollar_expand_underscore (d);
+            char list = dollar_expand_list (d);
+            char quote = dollar_expand_quote (d);
+            if (q)
+               quote = 0;
+            else if (quote)
+               tempputc (t, op, q = '"');
+            if (safe)
+            {
+               while (*v)
+               {
+                  if (*v == '\'' || *v == '"')
+                     tempputc (t, op, '_');
+                  else
+                     tempputc (t, op, *v);
+                  v++;
+               }
+            } else if (q)
+            {
+               while (*v)
+               {
+                  if (list && (*v == '\t' || *v == ','))
+                  {             // List comma
+                     tempputc (t, op, q);
+                     tempputc (t, op, ',');
+                     tempputc (t, op, q);
+                  } else
+                  {
+                     if (*v == q)
+                        tempputc (t, op, *v);
+                     tempputc (t, op, *v);
+                  }
+                  v++;
+               }
+            } else
+               tempputs (t, op, v, strlen (v)); // simple expansion
+            if (quote)
+            {
+               tempputc (t, op, q);
+               q = 0;
+            }
+         }
+      }
+   }
+   dollar_expand_free (&d);
+   *ip = i;
+   *qp = q;
+   return 0;
+}
+
+char *
+expandd (temp_t * t, const char *i, char sum)
+{                               // expand a string (sum set if allow variables without $ and default variables to zero, for maths in eval, etc)
+   if (!i)
+      return NULL;
+   {
+// Does it need expanding?
+      const char *p = i;
+      while (*p)
+      {
+         if ((*p == '$' && (isalpha (p[1]) || strchr (SQLEXPANDPREFIX, p[1])))
+#ifndef  BODGEEVAL
+             || (sum && isalpha (*p) && (p == i || !isalnum (p[-1])))
+#endif
+            )
+            break;
+         if (*p == '\\' && p[1])
+         {
+            p += 2;
+            continue;
+         }
+         p++;
+      }
+      if (!*p)
+         return (char *) i;     // Unchanged 
+   }
+   size_t o = 0;
+   char q = 0;
+   // Expand
+#ifndef  BODGEEVAL
+   const char *base = i;
+#endif
+   while (*i)
+   {
+      if ((*i == '$' && (isalpha (i[1]) || strchr (SQLEXPANDPREFIX, i[1])))
+#ifndef  BODGEEVAL
+          || (sum && isalpha (*i) && (i == base || !isalnum (i[-1])))
+#endif
+         )
+      {
+         if (expandref (&i, t, &o, &q, sum))
+            return NULL;
+      } else if (*i == '\\' && i[1])
+      {
+         tempputs (t, &o, i, 2);
+         i += 2;
+      } else                    // normal character
+      {
+         if (q && *i == q)
+            q = 0;
+         else if (*i == '\'' || *i == '"' || *i == '`')
+            q = *i;
+         tempputc (t, &o, *i++);
+      }
+   }
+   return tempend (t, o);
+}
+
+char *
+expand (temp_t * t, char *i)
+{
+   return expandd (t, i, 0);
+}
+
+char *
+expandz (temp_t * t, char *i)
+{
+   return expandd (t, i, 1);
+}
+
+// Attribute values compiled after parsing, so expand does not have to find and parse $ references every time
+#define	EXPANDSEGS	64      // max segments, else not compiled
+enum
+{
+   EXPANDTEXT,                  // literal text
+   EXPANDVAR,                   // plain $name or ${name}
+   EXPANDREF,                   // any other $ reference, parsed when expanded
+};
+typedef struct
+{
+   unsigned char type;
+   char qend[4];                // EXPANDTEXT: quote state after the text, indexed by quote state before
+   int len;                     // EXPANDTEXT: length
+   const char *p;               // text, variable name, or $ of reference
+} expandseg_t;
+typedef struct
+{
+   int segs;
+   expandseg_t seg[];
+} expandcomp_t;
+static expandcomp_t expandconst = { };  // value does not need expanding
+
+static const char expandquote[4] = { 0, '\'', '"', '`' };
+
+static inline int
+expandqindex (char q)
+{
+   return q == '\'' ? 1 : q == '"' ? 2 : q == '`' ? 3 : 0;
+}
+
+void
+expandcompile (xmlattr * a, xmlarena * arena)
+{                               // compile an attribute value, leaving NULL if it cannot be, in which case expand is used
+   a->expand = NULL;
+   if (!a->value)
+      return;
+   expandseg_t seg[EXPANDSEGS];
+   int n = 0,
+      refs = 0;
+   const char *p = a->value,
+      *t = p;
+   int text (void)
+   {                            // add text segment from t to p
+      if (p == t)
+         return 0;
+      if (n == EXPANDSEGS)
+         return -1;
+      expandseg_t *g = &seg[n++];
+      g->type = EXPANDTEXT;
+      g->p = t;
+      g->len = p - t;
+      int s;
+      for (s = 0; s < 4; s++)
+      {                         // same quote tracking as expandd
+         const char *c = t;
+         char q = expandquote[s];
+         while (c < p)
+         {
+            if (*c == '\\' && c + 1 < p)
+            {
+               c += 2;
+               continue;
+            }
+            if (q && *c == q)
+               q = 0;
+            else if (*c == '\'' || *c == '"' || *c == '`')
+               q = *c;
+            c++;
+         }
+         g->qend[s] = q;
+      }
+      return 0;
+   }
+   while (*p)
+   {
+      if (*p == '$' && (isalpha (p[1]) || strchr (SQLEXPANDPREFIX, p[1])))
+      {
+         if (text () || n == EXPANDSEGS)
+            return;
+         const char *i = p + 1,
+            *e = NULL;
+         dollar_expand_t *d = dollar_expand_parse (&i, &e);
+         if (!d || e)
+         {                      // leave expand to report the error
+            dollar_expand_free (&d);
+            return;
+         }
+         const char *name = dollar_expand_name (d);
+         expandseg_t *g = &seg[n++];
+         int l = (name ? strlen (name) : 0);
+         if (l && isalpha (*name) && strspn (name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_") == l
+             && !dollar_expand_query (d) && !dollar_expand_underscore (d) && !dollar_expand_list (d) && !dollar_expand_quote (d)
+             && !dollar_expand_literal (d) && ((i - p == l + 1 && !strncmp (p + 1, name, l))
+                                               || (i - p == l + 3 && p[1] == '{' && !strncmp (p + 2, name, l) && p[l + 2] == '}')))
+         {                      // plain variable, no processing needed
+            g->type = EXPANDVAR;
+            g->p = xmlarenastrdup (arena, name);
+         } else
+         {
+            g->type = EXPANDREF;
+            g->p = p;
+         }
+         dollar_expand_free (&d);
+         refs++;
+         p = t = i;
+         continue;
+      }
+      if (*p == '\\' && p[1])
+      {
+         p += 2;
+         continue;
+      }
+      p++;
+   }
+   if (!refs)
+   {
+      a->expand = &expandconst;
+      return;
+   }
+   if (text ())
+      return;
+   expandcomp_t *c = xmlarenaalloc (arena, sizeof (*c) + n * sizeof (*seg));
+   c->segs = n;
+   memcpy (c->seg, seg, n * sizeof (*seg));
+   a->expand = c;
+}
+
+char *
+expandattr (temp_t * t, xmlattr * a)
+{                               // expand an attribute value, using compiled value if possible
+   if (!a || !a->value)
+      return NULL;
+   expandcomp_t *c = a->expand;
+   if (c == &expandconst)
+      return a->value;          // Unchanged
+   if (!c)
+      return expand (t, a->value);
+   size_t o = 0;
+   char q = 0;
+   int s;
+   for (s = 0; s < c->segs; s++)
+   {
+      expandseg_t *g = &c->seg[s];
+      if (g->type == EXPANDTEXT)
+      {
+         tempputs (t, &o, g->p, g->len);
+         q = g->qend[expandqindex (q)];
+      } else if (g->type == EXPANDVAR)
+      {                         // as expandref for a reference with no flags
+         char *v = getvar (g->p, NULL, NULL, NULL);
+         if (!v)
+            continue;
+         if (q)
+            while (*v)
+            {
+               if (*v == q)
+                  tempputc (t, &o, *v);
+               tempputc (t, &o, *v++);
+            }
+         else
+            tempputs (t, &o, v, strlen (v));
+      } else
+      {
+         const char *i = g->p;
+         if (expandref (&i, t, &o, &q, 0))
+            return NULL;
+      }
+   }
+   return tempend (t, o);
+}
+
+char *
+expandx (temp_t * t, xmltoken * x, char *value)
+{                               // expand a value, using compiled value if it is one of the token's attribute values
+   if (!value)
+      return NULL;
+   if (x)
+   {
+      int a;
+      for (a = 0; a < x->attrs; a++)
+         if (x->attr[a].value == value)
+            return expandattr (t, &x->attr[a]);
+   }
+   return expand (t, value);
+}
+
+static void
+expandprint (FILE * f, xmltoken * x, char *value)
+{                               // expand a value straight to output
+   TEMP (temp);
+   char *v = expandx (&temp, x, value);
+   if (v)
+      fputs (v, f);
+}
+
+// Output escaping, a table per mode giving the replacement for each byte, so runs of clean bytes are written in one go
+enum
+{
+   ESC_RAW,                     // as is
+   ESC_HTML,                    // HTML text, new lines as <br>
+   ESC_TEXT,                    // TEXTAREA content
+   ESC_XML,                     // XML object
+   ESC_XMLMARKUP,               // XML object, leaving & for markup
+   ESC_JSON,                    // JSON string
+   ESC_CSV,                     // CSV quoted string
+   ESC_CSVNUM,                  // CSV unquoted
+   ESC_PS,                      // Postscript string
+   ESC_JS,                      // Javascript quoted string
+   ESC_MAX
+};
+typedef struct
+{
+   const char *rep[256];        // replacement, NULL if as is, "" to drop
+   char special[256];           // bytes that have a replacement, for strcspn
+   char crlf;                   // CR before LF is dropped
+} escmode_t;
+static escmode_t escmode[ESC_MAX];
+
+static void
+escinit (void)
+{                               // set up escape tables
+   static char num[3][256][8];  // numeric escapes
+   int c,
+     m;
+   for (c = 1; c < 256; c++)
+   {
+      sprintf (num[0][c], "&#%u;", c);
+      sprintf (num[1][c], "\\u%04X", c);
+      sprintf (num[2][c], "\\%03o", c);
+   }
+   for (c = 1; c < ' '; c++)
+   {
+      escmode[ESC_XML].rep[c] = escmode[ESC_XMLMARKUP].rep[c] = num[0][c];
+      escmode[ESC_JSON].rep[c] = num[1][c];
+      escmode[ESC_CSV].rep[c] = escmode[ESC_CSVNUM].rep[c] = "";
+      escmode[ESC_PS].rep[c] = num[2][c];
+   }
+   for (c = 127; c < 256; c++)
+      escmode[ESC_PS].rep[c] = num[2][c];
+   escmode[ESC_HTML].rep['\n'] = "<br>";
+   escmode[ESC_HTML].rep['\r'] = "<br>";
+   escmode[ESC_HTML].rep['\f'] = "<br><hr>";
+   escmode[ESC_HTML].rep['\''] = "&#39;";       //apos does not work in IE Except xml
+   escmode[ESC_HTML].crlf = 1;
+   escmode[ESC_HTML].rep['&'] = escmode[ESC_TEXT].rep['&'] = escmode[ESC_XML].rep['&'] = "&amp;";
+   escmode[ESC_HTML].rep['<'] = escmode[ESC_TEXT].rep['<'] = escmode[ESC_XML].rep['<'] = escmode[ESC_XMLMARKUP].rep['<'] = "&lt;";
+   escmode[ESC_HTML].rep['>'] = escmode[ESC_TEXT].rep['>'] = escmode[ESC_XML].rep['>'] = escmode[ESC_XMLMARKUP].rep['>'] = "&gt;";
+   escmode[ESC_JSON].rep['\n'] = "\\n";
+   escmode[ESC_JSON].rep['\r'] = "\\r";
+   escmode[ESC_JSON].rep['\t'] = "\\t";
+   escmode[ESC_JSON].rep['\b'] = "\\b";
+   escmode[ESC_JSON].rep['"'] = "\\\"";
+   escmode[ESC_JSON].rep['/'] = "\\/";  // Note escaping / is optional but done to avoid </script> issues
+   escmode[ESC_JSON].rep['\\'] = escmode[ESC_CSV].rep['\\'] = escmode[ESC_CSVNUM].rep['\\'] = escmode[ESC_PS].rep['\\'] =
+      escmode[ESC_JS].rep['\\'] = "\\\\";
+   escmode[ESC_CSV].rep['"'] = "\\\"";
+   escmode[ESC_PS].rep['\n'] = escmode[ESC_JS].rep['\n'] = "\\n";
+   escmode[ESC_PS].rep['('] = "\\(";
+   escmode[ESC_PS].rep[')'] = "\\)";
+   escmode[ESC_JS].rep['\''] = "\\'";
+   for (m = 0; m < ESC_MAX; m++)
+   {
+      char *p = escmode[m].special;
+      for (c = 1; c < 256; c++)
+         if (escmode[m].rep[c])
+            *p++ = c;
+      *p = 0;
+   }
+}
+
+static inline void
+escputc (FILE * f, int mode, unsigned char c)
+{
+   const char *r = escmode[mode].rep[c];
+   if (r)
+      fputs_unlocked (r, f);
+   else
+      putc_unlocked (c, f);
+}
+
+static void
+escputs (FILE * f, int mode, const char *s)
+{                               // write string escaped, strcspn finds the next byte needing escape
+   escmode_t *m = &escmode[mode];
+   while (*s)
+   {
+      size_t l = strcspn (s, m->special);
+      if (l)
+         fwrite_unlocked (s, 1, l, f);
+      s += l;
+      if (!*s)
+         break;
+      if (!m->crlf || *s != '\r' || s[1] != '\n')
+         fputs_unlocked (m->rep[*(unsigned char *) s], f);
+      s++;
+   }
+}
+
+static void
+escwrite (FILE * f, int mode, const char *s, size_t len)
+{                               // write escaped, may contain NULs
+   escmode_t *m = &escmode[mode];
+   const char *e = s + len;
+   while (s < e)
+   {
+      const char *p = s;
+      while (p < e && !m->rep[*(unsigned char *) p])
+         p++;
+      if (p > s)
+         fwrite_unlocked (s, 1, p - s, f);
+      if (p == e)
+         break;
+      if (!m->crlf || *p != '\r' || p + 1 == e || p[1] != '\n')
+         fputs_unlocked (m->rep[*(unsigned char *) p], f);
+      s = p + 1;
+   }
+}
+
+static void
+outopen (FILE * f)
+{                               // set up an output stream, large buffer and no locking as only we write to it
+   setvbuf (f, NULL, _IOFBF, OUTBUF);
+   __fsetlocking (f, FSETLOCKING_BYCALLER);
+}
+
+static ssize_t
+outcountwrite (void *c, const char *buf, size_t size)
+{
+   size_t o = 0;
+   while (o < size)
+   {
+      ssize_t l = write (fileno ((FILE *) c), buf + o, size - o);
+      if (l < 0 && errno == EINTR)
+         continue;
+      if (l <= 0)
+         return o ? : -1;
+      o += l;
+   }
+   outcounted += o;
+   return o;
+}
+
+static int
+outcountclose (void *c)
+{
+   return fclose ((FILE *) c);
+}
+
+FILE *outcounter = NULL;        // last stream from outcount
+int outcounterfd = -1;          // and the file descriptor it writes to
+
+FILE *
+outcount (FILE * f)
+{                               // output stream that counts bytes written, for SQL timing
+   fflush (f);                  // written directly from now on
+   FILE *o = fopencookie (f, "w", (cookie_io_functions_t) {.write = outcountwrite,.close = outcountclose });
+   if (!o)
+      err (1, "fopencookie");
+   outcounter = o;
+   outcounterfd = fileno (f);
+   return o;
+}
+
+static int
+outfileno (FILE * f)
+{                               // file descriptor for output stream, e.g. for EXEC, the one written to if from outcount
+   if (f && f == outcounter)
+      return outcounterfd;
+   return fileno (f);
+}
+
+static long long
+outpos (FILE * f)
+{                               // bytes output so far
+   long p = ftell (f);
+   if (p >= 0)
+      return p;
+   return outcounted + __fpending (f);
+}
+
+static double
+monotime (void)
+{                               // seconds, for timing
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void
+sqltime (xmltoken * x, const char *query, double t0, double tq, double tf, unsigned long long rows, long long bytes)
+{                               // note timing of an SQL tag, started at t0, query done at tq, result fetched at tf, rendered now
+   double t = monotime ();
+   if (sqlstats)
+   {
+      sqlstat_t **sp = &sqlstathash[((uintptr_t) x >> 4) % SQLSTATHASH],
+         *st;
+      while ((st = *sp) && st->x != x)
+         sp = &st->next;
+      if (!st)
+      {
+         if (!(st = *sp = calloc (1, sizeof (*st))))
+            errx (1, "malloc at line %d", __LINE__);
+         st->x = x;
+         if (asprintf (&st->where, "%s:%d", x->filename, x->line) < 0)
+            errx (1, "malloc at line %d", __LINE__);
+         sqlstatcount++;
+      }
+      st->runs++;
+      st->rows += rows;
+      st->bytes += bytes;
+      st->query += tq - t0;
+      st->fetch += tf - tq;
+      st->render += t - tf;
+   }
+   if (slowqueryms > 0 && (tf - t0) * 1000 >= slowqueryms)
+   {                            // JSON line
+      char *line = NULL;
+      size_t len = 0;
+      FILE *f = open_memstream (&line, &len);
+      fprintf (f, "{\"file\":\"");
+      escputs (f, ESC_JSON, x->filename);
+      fprintf (f, "\",\"line\":%d", x->line);
+      if (query)
+      {
+         fprintf (f, ",\"query\":\"");
+         escputs (f, ESC_JSON, query);
+         fputc ('"', f);
+      }
+      fprintf (f, ",\"rows\":%llu,\"bytes\":%lld,\"query_ms\":%.3f,\"fetch_ms\":%.3f,\"render_ms\":%.3f,\"time\":%ld}\n", rows,
+               bytes, (tq - t0) * 1000, (tf - tq) * 1000, (t - tf) * 1000, (long) time (0));
+      fclose (f);
+      int fd = (slowquerylog ? open (slowquerylog, O_WRONLY | O_APPEND | O_CREAT, 0666) : fileno (stderr));
+      if (fd < 0)
+         warn ("%s", slowquerylog);
+      else
+      {                         // one write, so lines from several processes are not mixed
+         if (write (fd, line, len) < 0)
+            warn ("%s", slowquerylog ? : "stderr");
+         if (slowquerylog)
+            close (fd);
+      }
+      free (line);
+   }
+}
+
+void
+sqlstatsdone (void)
+{                               // report and clear SQL timing, slowest first
+   if (!sqlstatcount)
+      return;
+   sqlstat_t **all = malloc (sqlstatcount * sizeof (*all));
+   if (!all)
+      errx (1, "malloc at line %d", __LINE__);
+   int h,
+     n = 0;
+   for (h = 0; h < SQLSTATHASH; h++)
+   {
+      sqlstat_t *st;
+      for (st = sqlstathash[h]; st; st = st->next)
+         all[n++] = st;
+      sqlstathash[h] = NULL;
+   }
+   int slower (const void *a, const void *b)
+   {
+      const sqlstat_t *A = *(sqlstat_t **) a,
+         *B = *(sqlstat_t **) b;
+      double ta = A->query + A->fetch + A->render,
+         tb = B->query + B->fetch + B->render;
+      return ta < tb ? 1 : ta > tb ? -1 : 0;
+   }
+   qsort (all, n, sizeof (*all), slower);
+   fprintf (stderr, "%-30s %6s %8s %10s %10s %10s %10s\n", "SQL", "Runs", "Rows", "Bytes", "Query ms", "Fetch ms", "Render ms");
+   for (h = 0; h < n; h++)
+   {
+      fprintf (stderr, "%-30s %6u %8llu %10lld %10.3f %10.3f %10.3f\n", all[h]->where, all[h]->runs, all[h]->rows, all[h]->bytes,
+               all[h]->query * 1000, all[h]->fetch * 1000, all[h]->render * 1000);
+      free (all[h]->where);
+      free (all[h]);
+   }
+   free (all);
+   sqlstatcount = 0;
+}
+
+static inline int
+xmode (int flags)
+{                               // escape mode for xputc
+   if (flags & FLAG_XML)
+      return (flags & FLAG_MARKUP) ? ESC_XMLMARKUP : ESC_XML;
+   if (flags & FLAG_JSON)
+      return ESC_JSON;
+   return ESC_RAW;
+}
+
+static inline void
+xputc (unsigned char c, FILE * f, int flags)
+{
+   escputc (f, xmode (flags), c);
+}
+
+static inline void
+xputs (char *s, FILE * f, int flags)
+{
+   escputs (f, xmode (flags), s);
+}
+
+// alternative writeattr for tagwrite to use.
+static void
+expandwriteattr (FILE * f, xmlattr * a)
+{
+   char *tag = a->attribute,
+      *value = a->value;
+   if (tag)
+   {
+      if (!value)
+         fprintf (f, " %s", tag);
       else
       {
          char *p;
@@ -639,8 +2192,8 @@ expandwriteattr (FILE * f, char *tag, char *value)
             fprintf (f, " %s=\"\"", tag);
          else
          {
-            char temp[MAXTEMP];
-            value = expand (temp, sizeof (temp), value);
+            TEMP (temp);
+            value = expandattr (&temp, a);
             if (value)
             {
                fprintf (f, " %s=\"", tag);
@@ -749,7 +2302,7 @@ tagwrite (FILE * f, xmltoken * t, ...)
          {                      // attributes
             for (a = 0; a < t->attrs; a++)
                if (!hide[a])
-                  expandwriteattr (f, t->attr[a].attribute, t->attr[a].value);
+                  expandwriteattr (f, &t->attr[a]);
             free (hide);
          }
       }
@@ -811,10 +2364,125 @@ info (xmltoken * x, char *w, ...)
 
 xmltoken *processxml (xmltoken * x, xmltoken * e, process_t * state);
 
+// Attribute index for a token, bit map of attribute IDs present and the attribute number for each in bit order
+typedef struct
+{
+   uint64_t present;            // IDs present
+   uint64_t beforebp;           // IDs present before MATCH or REPLACE breakpoint
+   unsigned char attr[];        // attribute number, for each bit set in present, in order
+} attindex_t;
+
+static const char *attname[ATT_MAX] = {
+   [ATT_ALL] = "ALL", [ATT_ALT] = "ALT", [ATT_ASC] = "ASC", [ATT_BASE64] = "BASE64", [ATT_BATCH] = "BATCH",
+   [ATT_BLANK] = "BLANK", [ATT_CACHE] = "CACHE", [ATT_CHECKED] = "CHECKED", [ATT_CLASS] = "CLASS", [ATT_CSV] = "CSV", [ATT_CSVHEAD] = "CSVHEAD", [ATT_DESC] = "DESC",
+   [ATT_DISTINCT] = "DISTINCT", [ATT_FAKESI] = "FAKESI", [ATT_FILE] = "FILE", [ATT_FORMAT] = "FORMAT",
+   [ATT_FROM] = "FROM", [ATT_GROUP] = "GROUP", [ATT_GROUPBY] = "GROUPBY", [ATT_HAVING] = "HAVING", [ATT_HREF] = "HREF",
+   [ATT_JSARRAY] = "JSARRAY", [ATT_JSARRAYHEAD] = "JSARRAYHEAD", [ATT_JSON] = "JSON", [ATT_KELVIN] = "KELVIN",
+   [ATT_KEY] = "KEY", [ATT_LIMIT] = "LIMIT", [ATT_MATCH] = "MATCH", [ATT_MAXLENGTH] = "MAXLENGTH",
+   [ATT_MEMO] = "MEMO", [ATT_MISSING] = "MISSING", [ATT_MULTIPLE] = "MULTIPLE", [ATT_NAME] = "NAME", [ATT_OBJECT] = "OBJECT",
+   [ATT_ORDER] = "ORDER", [ATT_ORDERBY] = "ORDERBY", [ATT_PATH] = "PATH", [ATT_QUERY] = "QUERY",
+   [ATT_REPLACE] = "REPLACE", [ATT_RIGHT] = "RIGHT", [ATT_SELECT] = "SELECT", [ATT_SET] = "SET", [ATT_SIZE] = "SIZE",
+   [ATT_SRC] = "SRC", [ATT_STREAM] = "STREAM", [ATT_STYLE] = "STYLE", [ATT_TABLE] = "TABLE",
+   [ATT_TABLEHEAD] = "TABLEHEAD", [ATT_TABLEROW] = "TABLEROW", [ATT_TARGET] = "TARGET", [ATT_TITLE] = "TITLE", [ATT_TRIM] = "TRIM", [ATT_TTL] = "TTL",
+   [ATT_TYPE] = "TYPE", [ATT_VALUE] = "VALUE", [ATT_VAR] = "VAR", [ATT_WHERE] = "WHERE", [ATT_XML] = "XML",
+};
+
+int
+attid (const char *n)
+{                               // attribute ID for name, ATT_NONE if not one we look up
+   static unsigned char hash[256];      // ID by hash of name, 0 if not set
+   if (!*hash)
+   {                            // make hash table, hash[0] set (not a valid slot) to mark as done
+      int i;
+      *hash = 1;
+      for (i = 1; i < ATT_MAX; i++)
+      {
+         const char *p;
+         unsigned char h = 0;
+         for (p = attname[i]; *p; p++)
+            h = h * 31 + *p;
+         while (!h || hash[h])
+            h++;
+         hash[h] = i;
+      }
+   }
+   unsigned char h = 0;
+   const char *p;
+   for (p = n; *p; p++)
+      h = h * 31 + toupper (*p);
+   while (!h || hash[h])
+   {
+      if (h && !strcasecmp (attname[hash[h]], n))
+         return hash[h];
+      h++;
+   }
+   return ATT_NONE;
+}
+
+void
+attindex (xmltoken * x, xmlarena * arena)
+{                               // make attribute index for a token, and compile attribute values
+   x->index = NULL;
+   if (!(x->type & XML_START) || !x->attrs)
+      return;
+   int a;
+   for (a = 0; a < x->attrs; a++)
+      expandcompile (&x->attr[a], arena);
+   unsigned char first[ATT_MAX];
+   uint64_t present = 0,
+      beforebp = 0;
+   int bp = 0;
+   for (a = 0; a < x->attrs; a++)
+      if (x->attr[a].attribute)
+      {
+         int id = attid (x->attr[a].attribute);
+         if (id && !(present & (1ULL << id)))
+         {
+            present |= (1ULL << id);
+            first[id] = a;
+            if (!bp)
+               beforebp |= (1ULL << id);
+         }
+         if (!x->attr[a].value && (id == ATT_MATCH || id == ATT_REPLACE))
+            bp = 1;             // xmlfindattrbp stops here
+      }
+   if (!present)
+      return;
+   attindex_t *i = xmlarenaalloc (arena, sizeof (*i) + __builtin_popcountll (present));
+   i->present = present;
+   i->beforebp = beforebp;
+   int n = 0;
+   for (a = 1; a < ATT_MAX; a++)
+      if (present & (1ULL << a))
+         i->attr[n++] = first[a];
+   x->index = i;
+}
+
+xmlattr *
+findattbp (xmltoken * x, int id, int bp)
+{                               // find an attribute by ID, stopping at a MATCH or REPLACE breakpoint if bp set
+   if (!x)
+      return NULL;
+   if (x->styles)
+   {                            // styles not indexed
+      static char *breakpoint[] = { "MATCH", "REPLACE", 0 };
+      return xmlfindattrbp (x, (char *) attname[id], bp ? breakpoint : NULL);
+   }
+   attindex_t *i = x->index;
+   if (!i)
+      return NULL;
+   uint64_t b = (1ULL << id);
+   if (!((bp ? i->beforebp : i->present) & b))
+      return NULL;
+   return &x->attr[i->attr[__builtin_popcountll (i->present & (b - 1))]];
+}
+
+#define findatt(x,i) findattbp(x,i,0)
+
 char *
-getattbp (xmltoken * x, char *n, char **breakpoint)
+getattbp (xmltoken * x, int id, int bp)
 {                               // get an attribute (if it has a value)
-   xmlattr *a = xmlfindattrbp (x, n, breakpoint);
+   xmlattr *a = findattbp (x, id, bp);
    if (a && a->value)
       return a->value;
    return 0;
@@ -933,15 +2601,15 @@ writeoutput (xmltoken * x, char *v, char *e, int hasreplace, int flags, int ps,
             }
             if (match == 2 && x->attr[a].attribute)
             {
-               char temptag[1000];
-               char *t = expand (temptag, sizeof (temptag), x->attr[a].attribute);
+               TEMP (temptag);
+               char *t = expand (&temptag, x->attr[a].attribute);
                if (t)
                {
                   int l = strlen (t);
                   if (l && e - v >= l && !strncmp (v, t, l))
                   {
-                     char tempval[1000];
-                     char *e = expand (tempval, sizeof (tempval), x->attr[a].value);
+                     TEMP (tempval);
+                     char *e = expandattr (&tempval, &x->attr[a]);
                      if (e)
                      {
                         (*count) += strlen (e);
@@ -1240,18 +2908,12 @@ writeoutput (xmltoken * x, char *v, char *e, int hasreplace, int flags, int ps,
             v += 5;
          }
 
-         if (C == '\n')
-            fprintf (of, "\\n");
-         else if (C == '(' || C == ')' || C == '\\')
-            fprintf (of, "\\%c", (char) C);
-         else if (C == 8364)
-            fprintf (of, "\\200");
+         if (C == 8364)
+            fputs ("\\200", of);
          else if (C >= 256)
-            fprintf (of, "_");
-         else if (C < ' ' || C >= 127)
-            fprintf (of, "\\%03o", (unsigned int) (255 & C));
+            fputc ('_', of);
          else
-            fputc (C, of);
+            escputc (of, ESC_PS, C);
          v--;
       } else
       {
@@ -1273,14 +2935,8 @@ writeoutput (xmltoken * x, char *v, char *e, int hasreplace, int flags, int ps,
                xputs ("<br><hr>", of, flags);
          }
          //else if (*v == (char) 160) fprintf (of, "&nbsp;");
-         else if (*v == '\'')
-            fprintf (of, "&#39;");      //apos does not work in IE Except xml
-         else if (*v == '&')
-            fprintf (of, "&amp;");
-         else if (*v == '<')
-            fprintf (of, "&lt;");
-         else if (*v == '>')
-            fprintf (of, "&gt;");
+         else if (*v == '\'' || *v == '&' || *v == '<' || *v == '>')
+            escputc (of, ESC_HTML, *v);
          else if (*v & 0x80)
          {                      // utf handling
             int n = 0;
@@ -1322,37 +2978,38 @@ writeoutput (xmltoken * x, char *v, char *e, int hasreplace, int flags, int ps,
 xmltoken *
 dooutput (xmltoken * x, process_t * state)
 {                               // do output function
-   static char *breakpoint[] = { "MATCH", "REPLACE", 0 };
    char ps = 0;
    int flags = 0;
-   char temp[65536];
-   char tempval[65536];
-   char tempname[256];
-   char temptype[100];
+   TEMP (tempbuf);
+   TEMP (tempval);
+   TEMP (tempname);
+   TEMP (temptype);
+   char *temp = NULL;           // formatted value, in tempbuf
+   size_t tempsize = 0;
    char *v = 0;
-   char *file = getattbp (x, "FILE", breakpoint);
-   char *name = getattbp (x, "NAME", breakpoint);
-   char *blank = getattbp (x, "BLANK", breakpoint);
-   char *missing = getattbp (x, "MISSING", breakpoint);
-   char *value = getattbp (x, "VALUE", breakpoint);
-   char *type = getattbp (x, "TYPE", breakpoint);
-   char *format = getattbp (x, "FORMAT", breakpoint);
-   char *href = getattbp (x, "HREF", breakpoint);
-   char *target = getattbp (x, "TARGET", breakpoint);
-   char *style = getattbp (x, "STYLE", breakpoint);
-   char *class = getattbp (x, "CLASS", breakpoint);
-   char *size = getattbp (x, "SIZE", breakpoint);
-   xmlattr *right = xmlfindattrbp (x, "RIGHT", breakpoint);
+   char *file = getattbp (x, ATT_FILE, 1);
+   char *name = getattbp (x, ATT_NAME, 1);
+   char *blank = getattbp (x, ATT_BLANK, 1);
+   char *missing = getattbp (x, ATT_MISSING, 1);
+   char *value = getattbp (x, ATT_VALUE, 1);
+   char *type = getattbp (x, ATT_TYPE, 1);
+   char *format = getattbp (x, ATT_FORMAT, 1);
+   char *href = getattbp (x, ATT_HREF, 1);
+   char *target = getattbp (x, ATT_TARGET, 1);
+   char *style = getattbp (x, ATT_STYLE, 1);
+   char *class = getattbp (x, ATT_CLASS, 1);
+   char *size = getattbp (x, ATT_SIZE, 1);
+   xmlattr *right = findattbp (x, ATT_RIGHT, 1);
    int hasreplace = 0;
    int maxsize = 0;
 
-   if (xmlfindattrbp (x, "XML", breakpoint))
+   if (findattbp (x, ATT_XML, 1))
       flags |= FLAG_XML;
 
    if (file)
    {
       value = NULL;
-      char *v = expand (tempval, sizeof (tempval), file);
+      char *v = expandx (&tempval, x, file);
       if (v)
       {
          FILE *i = fopen (v, "r");
@@ -1372,7 +3029,7 @@ dooutput (xmltoken * x, process_t * state)
 
    if (size)
    {
-      char *v = expand (tempval, sizeof (tempval), size);
+      char *v = expandx (&tempval, x, size);
       if (v)
          maxsize = atoi (v);
    }
@@ -1387,13 +3044,13 @@ dooutput (xmltoken * x, process_t * state)
       warning (x, "TARGET with no HREF in OUTPUT");
 
    if (name)
-      v = getvar (expand (tempname, sizeof (tempname), name), NULL, NULL, NULL);
+      v = getvar (expandx (&tempname, x, name), NULL, NULL, NULL);
    if (!v && value)
-      v = expand (tempval, sizeof (tempval), value);
+      v = expandx (&tempval, x, value);
 
    if (type && v)
    {                            // special format controls
-      type = expand (temptype, sizeof (temptype), type);
+      type = expandx (&temptype, x, type);
    }
    if (type && v)
    {
@@ -1426,6 +3083,8 @@ dooutput (xmltoken * x, process_t * state)
    }
    if (type && v)
    {                            // Types that change the content in various ways
+      tempsize = strlen (v) * 6 + 1000; // enough for any of the formats below
+      temp = tempneed (&tempbuf, tempsize);
       char *skiptitle (char *v)
       {                         // Skip a title on a name
          char *e = strchr (v, ' ');
@@ -1486,10 +3145,10 @@ dooutput (xmltoken * x, process_t * state)
       {                         /* time stamp print */
          struct tm t = *localtime (&when);
          char *d = strrchr (v, '.');
-         strftime ((v = temp), sizeof (temp), type, &t);
-         if (d && strlen (d) < sizeof (temp) - strlen (temp) - 1 && (strstr (type, "%T") || strstr (type, "%S")))
+         strftime ((v = temp), tempsize, type, &t);
+         if (d && strlen (d) < tempsize - strlen (temp) - 1 && (strstr (type, "%T") || strstr (type, "%S")))
             strcat (temp, d);
-         if (addtz && strlen (temp) + 7 < sizeof (temp))
+         if (addtz && strlen (temp) + 7 < tempsize)
          {                      // time zone suffix RFC3339 format
 #ifdef __CYGWIN__
             // tm_gmtoff is a BSD extension which Linux has but Cygwin doesn't
@@ -1539,7 +3198,7 @@ dooutput (xmltoken * x, process_t * state)
          if (!readtime (v, &when))
          {
             if (blank)
-               printf ("%s", expand (tempval, sizeof (tempval), blank));
+               expandprint (of, x, blank);
          } else
          {
             time_t now = time (0);
@@ -1557,7 +3216,7 @@ dooutput (xmltoken * x, process_t * state)
                type = "%A %H:%M:%S";
             else
                type = "%_d %b %H:%M:%S";
-            strftime (temp, sizeof (temp), type, &w);
+            strftime (temp, tempsize, type, &w);
             if (strlen (temp) > 9 && !strcmp (temp + strlen (temp) - 9, " 00:00:00"))
                temp[strlen (temp) - 9] = 0;
             v = temp;
@@ -1592,7 +3251,7 @@ dooutput (xmltoken * x, process_t * state)
          }
          if (l == 3)
          {
-            if (xmlfindattrbp (x, "KELVIN", breakpoint))
+            if (findattbp (x, ATT_KELVIN, 1))
                *o++ = 'K';      // bodge
             else
                *o++ = 'k';      // Kilo is lower case k, else would be Kelvin
@@ -1637,7 +3296,7 @@ dooutput (xmltoken * x, process_t * state)
             n = ((n * 100ULL) >> 20ULL);
          } else if (n >= 1000ULL)
          {
-            if (!xmlfindattrbp (x, "FAKESI", breakpoint) || xmlfindattrbp (x, "KELVIN", breakpoint))
+            if (!findattbp (x, ATT_FAKESI, 1) || findattbp (x, ATT_KELVIN, 1))
                suffix = 'K';    // Kibi is Ki, somewhat inconsitently with k for Kilo.
             else
                suffix = 'k';
@@ -1655,7 +3314,7 @@ dooutput (xmltoken * x, process_t * state)
          if (suffix)
          {
             *o++ = suffix;
-            if (!xmlfindattrbp (x, "FAKESI", breakpoint))
+            if (!findattbp (x, ATT_FAKESI, 1))
                *o++ = 'i';
          }
          *o = 0;
@@ -1851,7 +3510,7 @@ dooutput (xmltoken * x, process_t * state)
                *o++ = ' ';
             }
 
-            while (*v && o < temp + sizeof (temp) - 1)
+            while (*v && o < temp + tempsize - 1)
                *o++ = *v++;
             *o = 0;
             v = temp;
@@ -1894,7 +3553,7 @@ dooutput (xmltoken * x, process_t * state)
          if (!when)
          {
             if (blank)
-               printf ("%s", expand (tempval, sizeof (tempval), blank));
+               expandprint (of, x, blank);
          } else
          {
             struct tm w = *localtime (&when);
@@ -1917,7 +3576,7 @@ dooutput (xmltoken * x, process_t * state)
          if (!when)
          {
             if (blank)
-               printf ("%s", expand (tempval, sizeof (tempval), blank));
+               expandprint (of, x, blank);
          } else
          {
             const char *frac[] = { "", "¼", "½", "¾" };
@@ -2070,7 +3729,7 @@ dooutput (xmltoken * x, process_t * state)
          }
       } else if (!strcasecmp (type, "SURNAME"))
       {
-         strncpy (temp, v, sizeof (temp));
+         strncpy (temp, v, tempsize);
          v = skiptitle (temp);
          char *s = strrchr (v, ' ');
          if (s)
@@ -2078,7 +3737,7 @@ dooutput (xmltoken * x, process_t * state)
          initialise (v);
       } else if (!strcasecmp (type, "FORENAME"))
       {
-         strncpy (temp, v, sizeof (temp));
+         strncpy (temp, v, tempsize);
          v = skiptitle (temp);
          char *s = strchr (v, ' ');
          if (s)
@@ -2086,7 +3745,7 @@ dooutput (xmltoken * x, process_t * state)
          initialise (v);
       } else if (!strcasecmp (type, "FORENAMES"))
       {
-         strncpy (temp, v, sizeof (temp));
+         strncpy (temp, v, tempsize);
          v = skiptitle (temp);
          char *s = strrchr (v, ' ');
          if (s)
@@ -2094,7 +3753,7 @@ dooutput (xmltoken * x, process_t * state)
          initialise (v);
       } else if (!strcasecmp (type, "TITLE"))
       {
-         strncpy (temp, v, sizeof (temp));
+         strncpy (temp, v, tempsize);
          v = temp;
          char *e = skiptitle (v);
          if (v == e)
@@ -2132,12 +3791,12 @@ dooutput (xmltoken * x, process_t * state)
                  && strcasecmp (x->attr[a].attribute, "value") && strcasecmp (x->attr[a].attribute, "TYPE")
                  && strcasecmp (x->attr[a].attribute, "STYLE") && strcasecmp (x->attr[a].attribute, "CLASS")))
             {                   // legacy
-               v = expand (tempval, sizeof (tempval), x->attr[a].value);
+               v = expandattr (&tempval, &x->attr[a]);
                break;
             }
             if (match == 1 && !strcmp (x->attr[a].attribute, v))
             {                   // match, case specific exact match
-               v = expand (tempval, sizeof (tempval), x->attr[a].value);
+               v = expandattr (&tempval, &x->attr[a]);
                break;
             }
 
@@ -2145,38 +3804,38 @@ dooutput (xmltoken * x, process_t * state)
    }
    // Defaults
    if (!v && missing)
-      v = expand (tempval, sizeof (tempval), missing);
+      v = expandx (&tempval, x, missing);
    else if (v && !*v && blank)
-      v = expand (tempval, sizeof (tempval), blank);
+      v = expandx (&tempval, x, blank);
 
    if (v && *v)
    {                            // output
       char *b = v;
       if (href)
       {
-         char tempatt[MAXTEMP];
-         char *ta = expand (tempatt, sizeof (tempatt), href);
+         TEMP (tempatt);
+         char *ta = expandx (&tempatt, x, href);
          if (*ta)
          {
             fprintf (of, "<a");
             xmlwriteattr (of, "href", ta);
             if (class)
-               xmlwriteattr (of, "class", expand (tempatt, sizeof (tempatt), class));
+               xmlwriteattr (of, "class", expandx (&tempatt, x, class));
             if (style)
-               xmlwriteattr (of, "style", expand (tempatt, sizeof (tempatt), style));
+               xmlwriteattr (of, "style", expandx (&tempatt, x, style));
             if (target)
-               xmlwriteattr (of, "target", expand (tempatt, sizeof (tempatt), target));
+               xmlwriteattr (of, "target", expandx (&tempatt, x, target));
             fprintf (of, ">");
          } else
             href = 0;
       } else if (class || style)
       {
-         char tempatt[MAXTEMP];
+         TEMP (tempatt);
          fprintf (of, "<span");
          if (class)
-            xmlwriteattr (of, "class", expand (tempatt, sizeof (tempatt), class));
+            xmlwriteattr (of, "class", expandx (&tempatt, x, class));
          if (style)
-            xmlwriteattr (of, "style", expand (tempatt, sizeof (tempatt), style));
+            xmlwriteattr (of, "style", expandx (&tempatt, x, style));
          fprintf (of, ">");
       }
       if (right && maxsize)
@@ -2236,70 +3895,80 @@ dodir (xmltoken * x, process_t * state)
       warning (x, "Unclosed %s tag", x->content);
       return x->next;
    }
-   xmlattr *all = xmlfindattr (x, "ALL");
-   char *path = getatt (x, "PATH");
+   xmlattr *all = findatt (x, ATT_ALL);
+   char *path = getatt (x, ATT_PATH);
    if (!path)
       path = ".";
-   char temp[MAXTEMP];
-   path = expand (temp, sizeof (temp), path);
+   TEMP (temp);
+   path = expandx (&temp, x, path);
    struct stat s;
+   int scope = varscope ();
+   varlocal ("FILENAME");
+   varlocal ("FILELEAF");
+   varlocal ("FILEEXT");
+   varlocal ("FILETYPE");
+   varlocal ("FILEMODE");
+   varlocal ("FILESIZE");
+   varlocal ("FILEMTIME");
+   varlocal ("FILECTIME");
+   varlocal ("FILEATIME");
    void found (char *fn, int statres)
    {                            // expects stat done
-      setenv ("FILENAME", fn, 1);
+      varset ("FILENAME", fn);
       char *leaf = strrchr (fn, '/');
       if (leaf)
          leaf++;
       else
          leaf = fn;
-      setenv ("FILELEAF", leaf, 1);
+      varset ("FILELEAF", leaf);
 
       char *ext = strrchr (fn, '.');
       if (ext)
-         setenv ("FILEEXT", ext + 1, 1);
+         varset ("FILEEXT", ext + 1);
 
       if (!statres)
       {
          if (S_ISREG (s.st_mode))
-            setenv ("FILETYPE", "FILE", 1);
+            varset ("FILETYPE", "FILE");
          else if (S_ISDIR (s.st_mode))
-            setenv ("FILETYPE", "DIR", 1);
+            varset ("FILETYPE", "DIR");
          else if (S_ISCHR (s.st_mode))
-            setenv ("FILETYPE", "CHR", 1);
+            varset ("FILETYPE", "CHR");
          else if (S_ISBLK (s.st_mode))
-            setenv ("FILETYPE", "BLK", 1);
+            varset ("FILETYPE", "BLK");
          else if (S_ISFIFO (s.st_mode))
-            setenv ("FILETYPE", "FIFO", 1);
+            varset ("FILETYPE", "FIFO");
          else if (S_ISLNK (s.st_mode))
-            setenv ("FILETYPE", "LINK", 1);
+            varset ("FILETYPE", "LINK");
          else if (S_ISSOCK (s.st_mode))
-            setenv ("FILETYPE", "SOCK", 1);
+            varset ("FILETYPE", "SOCK");
          else
-            setenv ("FILETYPE", "UNKNOWN", 1);
+            varset ("FILETYPE", "UNKNOWN");
          char temp[100];
          sprintf (temp, "%o", s.st_mode & 0777);
-         setenv ("FILEMODE", temp, 1);
+         varset ("FILEMODE", temp);
          sprintf (temp, "%ld", s.st_size);
-         setenv ("FILESIZE", temp, 1);
+         varset ("FILESIZE", temp);
          strftime (temp, sizeof (temp), "%F %T", localtime (&s.st_mtime));
-         setenv ("FILEMTIME", temp, 1);
+         varset ("FILEMTIME", temp);
          strftime (temp, sizeof (temp), "%F %T", localtime (&s.st_ctime));
-         setenv ("FILECTIME", temp, 1);
+         varset ("FILECTIME", temp);
          strftime (temp, sizeof (temp), "%F %T", localtime (&s.st_atime));
-         setenv ("FILEATIME", temp, 1);
+         varset ("FILEATIME", temp);
       }
       processxml (x->next, x->end, state);
       if (statres)
       {
-         unsetenv ("FILETYPE");
-         unsetenv ("FILEMODE");
-         unsetenv ("FILESIZE");
-         unsetenv ("FILEMTIME");
-         unsetenv ("FILECTIME");
-         unsetenv ("FILEATIME");
+         varunset ("FILETYPE");
+         varunset ("FILEMODE");
+         varunset ("FILESIZE");
+         varunset ("FILEMTIME");
+         varunset ("FILECTIME");
+         varunset ("FILEATIME");
       }
-      unsetenv ("FILENAME");
-      unsetenv ("FILELEAF");
-      unsetenv ("FILEEXT");
+      varunset ("FILENAME");
+      varunset ("FILELEAF");
+      varunset ("FILEEXT");
    }
    if (!stat (path, &s) && S_ISDIR (s.st_mode))
    {                            // Dir scan
@@ -2308,6 +3977,7 @@ dodir (xmltoken * x, process_t * state)
       if (!d)
       {
          warning (x, "Cannot directory list %s", path);
+         varscopeend (scope);
          return x->next;
       }
       int dirfd = open (path, O_RDONLY);
@@ -2315,6 +3985,7 @@ dodir (xmltoken * x, process_t * state)
       {
          warning (x, "Cannot open list %s", path);
          close (dirfd);
+         varscopeend (scope);
          return x->next;
       }
       while ((e = readdir (d)))
@@ -2327,6 +3998,7 @@ dodir (xmltoken * x, process_t * state)
       if (glob (path, GLOB_TILDE_CHECK + (all ? GLOB_PERIOD : 0), NULL, &pglob))
       {
          warning (x, "Cannot match %s", path);
+         varscopeend (scope);
          return x->end->next;
       }
       //  fprintf (stderr, "Glob %ld\n", pglob.gl_pathc);
@@ -2335,6 +4007,7 @@ dodir (xmltoken * x, process_t * state)
          found (pglob.gl_pathv[n], lstat (pglob.gl_pathv[n], &s));
       globfree (&pglob);
    }
+   varscopeend (scope);
    return x->end->next;
 }
 
@@ -2360,8 +4033,11 @@ dofor (xmltoken * x, process_t * state)
       char *v = x->attr[a].value;
       if (v)
       {
-         char temp[MAXTEMP];
-         v = expand (temp, sizeof (temp), v);
+         TEMP (tempv);
+         char temp[100];
+         int scope = varscope ();
+         varlocal (n);          // restored after loop
+         v = expandx (&tempv, x, v);
          if (period)
          {                      // loop
             char *p = v;
@@ -2378,9 +4054,8 @@ dofor (xmltoken * x, process_t * state)
                   while (f <= t)
                   {
                      snprintf (temp, sizeof (temp), "%d", f);
-                     setenv (n, temp, 1);
+                     varset (n, temp);
                      processxml (x->next, x->end, state);
-                     unsetenv (n);
                      f++;
                   }
                } else if (period == 'D')
@@ -2390,9 +4065,8 @@ dofor (xmltoken * x, process_t * state)
                   while (f >= t)
                   {
                      snprintf (temp, sizeof (temp), "%d", f);
-                     setenv (n, temp, 1);
+                     varset (n, temp);
                      processxml (x->next, x->end, state);
-                     unsetenv (n);
                      f--;
                   }
                } else
@@ -2422,9 +4096,8 @@ dofor (xmltoken * x, process_t * state)
                   {
                      snprintf (temp, sizeof (temp), "%04d-%02d-%02d %02d:%02d:%02d", f.tm_year + 1900, f.tm_mon + 1, f.tm_mday,
                                f.tm_hour, f.tm_min, f.tm_sec);
-                     setenv (n, temp, 1);
+                     varset (n, temp);
                      processxml (x->next, x->end, state);
-                     unsetenv (n);
                      switch (period)
                      {
                      case 'S':
@@ -2465,12 +4138,12 @@ dofor (xmltoken * x, process_t * state)
                char c = *v;
                if (c)
                   *v = 0;
-               setenv (n, p, 1);
+               varset (n, p);
                if (c)
                   *v++ = c;
                processxml (x->next, x->end, state);
-               unsetenv (n);
             }
+         varscopeend (scope);
       } else
       {
          if (!strcasecmp (n, "SPACE"))
@@ -2513,7 +4186,6 @@ doif (xmltoken * x, process_t * state)
    int a = 0;
    char neg = 0;
    char istrue = 1;
-   static char lastif = 0;
    if (!x->end)
    {
       warning (x, "Unclosed %s tag", x->content);
@@ -2545,13 +4217,13 @@ doif (xmltoken * x, process_t * state)
    }
    while (a < x->attrs)
    {
-      char temp[MAXTEMP];
+      TEMP (temp);
       char *n = x->attr[a].attribute;
       char *v = x->attr[a].value;
       adddebug (" %s", n);
       if (n)
       {
-         char *r = expand (temp, sizeof (temp), n);
+         char *r = expand (&temp, n);
          if (strcmp (r, n))
             adddebug ("[%s]", r);
          n = r;
@@ -2578,15 +4250,15 @@ doif (xmltoken * x, process_t * state)
          break;                 // done
       } else if (!v && !strcasecmp (n, "ELSE"))
       {
-         istrue = ((!lastif) ? !neg : neg);
+         istrue = ((!iflast) ? !neg : neg);
       } else if (v && !strcasecmp (n, "EXISTS"))
       {                         // file exists
-         char *t = expand (temp, sizeof (temp), v);
+         char *t = expandx (&temp, x, v);
          adddebug ("[%s]", t);
          istrue = (access (t, R_OK) ? neg : !neg);
       } else if (v)
       {                         // NAME=X
-         char temp[MAXTEMP];
+         TEMP (temp);
          char *z = getvar (n, NULL, NULL, NULL);
          char *e = v;
          char *t;
@@ -2601,7 +4273,7 @@ doif (xmltoken * x, process_t * state)
                e++;             // numeric prefix
             if (strchr ("+-=&*", *e))
                e++;
-            t = expand (temp, sizeof (temp), e);
+            t = expandx (&temp, x, e);
             if (strcmp (t, e))
                adddebug ("[%s]", t ? : "null");
             if (*v == '+')      // string >
@@ -2671,7 +4343,7 @@ doif (xmltoken * x, process_t * state)
          iflevel--;
          if (debug > 1)
             info (x, "%s%d: end", x->content, iflevel);
-         if (!strcasecmp (x->content, "WHILE"))
+         if (x->tag == TAG_WHILE)
          {
             if (debuginfo)
                free (debuginfo);
@@ -2684,7 +4356,7 @@ doif (xmltoken * x, process_t * state)
       }
    }
    x = x->end;
-   lastif = istrue;
+   iflast = istrue;
    if (debuginfo)
       free (debuginfo);
    return x->next;
@@ -2715,23 +4387,23 @@ doset (xmltoken * x, process_t * state)
    for (a = 0; a < x->attrs; a++)
       if (x->attr[a].attribute)
       {
-         char tempa[MAXTEMP];
-         char *va = expand (tempa, sizeof (tempa), x->attr[a].attribute);
+         TEMP (tempa);
+         char *va = expand (&tempa, x->attr[a].attribute);
          if (x->attr[a].value)
          {
-            char temp[MAXTEMP];
-            char *v = expand (temp, sizeof (temp), x->attr[a].value);
+            TEMP (temp);
+            char *v = expandattr (&temp, &x->attr[a]);
             if (!v)
                warnx ("Failed to expand: %s", x->attr[a].value);
             else
             {
-               setenv (va, v, 1);
+               varset (va, v);
                if (comment || debug)
                   info (x, "%s=%s", va, v);
             }
          } else
          {
-            unsetenv (va);
+            varunset (va);
             if (comment || debug)
                info (x, "unset %s", va);
          }
@@ -2776,10 +4448,10 @@ doeval (xmltoken * x, process_t * state)
                format = *p;
          } else if (x->attr[a].value)
          {
-            char tempa[MAXTEMP];
-            char *va = expand (tempa, sizeof (tempa), x->attr[a].attribute);
-            char temp[MAXTEMP];
-            char *v = expandz (temp, sizeof (temp), x->attr[a].value);
+            TEMP (tempa);
+            char *va = expand (&tempa, x->attr[a].attribute);
+            TEMP (temp);
+            char *v = expandz (&temp, x->attr[a].value);
             if (!va)
                warnx ("Failed to expand: %s", x->attr[a].attribute);
             else if (!v)
@@ -2807,23 +4479,813 @@ doeval (xmltoken * x, process_t * state)
                   if (comment || debug)
                      info (x, "Eval %s = %s = %s = %s format=%c round=%c places=%d\n", va, x->attr[a].value, v, e, format ? : '?',
                            round ? : '?', places);
-                  setenv (va, e, 1);
+                  varset (va, e);
                   free (e);
                } else
                {
                   if (comment || debug)
                      info (x, "Unset %s", va);
-                  unsetenv (va);
+                  varunset (va);
                }
             }
          } else
          {
-            unsetenv (x->attr[a].attribute);
+            varunset (x->attr[a].attribute);
             if (comment || debug)
                info (x, "unset %s", x->attr[a].attribute);
          }
       }
-   return x->next;
+   return x->next;
+}
+
+static int
+sqlnumber (const char *v)
+{                               // is a plain number, so means the same in a query unquoted or as a parameter
+   if (v && *v == '-')
+      v++;
+   if (!v || !isdigit (*v))
+      return 0;
+   while (isdigit (*v))
+      v++;
+   if (*v == '.' && isdigit (v[1]))
+      for (v++; isdigit (*v); v++);
+   return !*v;
+}
+
+static int
+sqlparamok (const char *v, char quoted)
+{                               // value can be passed separately and mean the same as in the text query, quoted 1 for '$var', 2 for KEY
+   if (!quoted)
+      return sqlnumber (v);
+   return !v || (!strchr (v, '\\') && !strchr (v, quoted == 2 ? '\'' : '&'));
+}
+
+static sqlprep_t **
+sqlprepfind (xmltoken * x, int conn)
+{                               // find cached statement entry for SQL token on connection
+   sqlprep_t **pp = &sqlprephash[(((uintptr_t) x >> 4) ^ conn) % SQLPREPHASH],
+      *p;
+   while ((p = *pp) && (p->x != x || p->conn != conn))
+      pp = &p->next;
+   return pp;
+}
+
+static int
+sqlprepquery (xmltoken * x, sqlprep_t * p)
+{                               // build query with ? for plain variables as dosql would construct it, -1 if it cannot be prepared
+   TEMP (temp);
+   size_t o = 0,
+      qstart = 0;
+   char q = 0;                  // quote state as the SQL server sees it
+   int e = 0;
+   void put (const char *s, int l)
+   {                            // add text, tracking quotes as the sanity check in dosql does
+      while (l-- > 0)
+      {
+         char c = *s++;
+         tempputc (&temp, &o, c);
+         if (c == '\\' && l)
+         {
+            tempputc (&temp, &o, *s++);
+            l--;
+            continue;
+         }
+         if (q && c == q && l && *s == q)
+         {                      // doubled quote
+            tempputc (&temp, &o, *s++);
+            l--;
+         } else if (q && c == q)
+            q = 0;
+         else if (!q && (c == '`' || c == '\'' || c == '"'))
+         {
+            q = c;
+            qstart = o - 1;
+         } else if (!q && (c == ';' || c == '#' || (c == '-' && l && *s == '-') || (c == '/' && l && *s == '*')))
+            e = -1;             // let dosql report it
+      }
+   }
+   void param (const char *name, char quoted)
+   {
+      if (!(p->params & 15) && !(p->param = realloc (p->param, (p->params + 16) * sizeof (*p->param))))
+         errx (1, "malloc at line %d", __LINE__);
+      p->param[p->params].name = name;
+      p->param[p->params].quoted = quoted;
+      p->params++;
+      tempputc (&temp, &o, '?');
+   }
+   void add (xmlattr * a, char refs)
+   {                            // add attribute value, only plain variables allowed and only if refs set
+      expandcomp_t *c = a->expand;
+      if (c == &expandconst)
+      {
+         put (a->value, strlen (a->value));
+         return;
+      }
+      if (!c || !refs)
+      {
+         e = -1;
+         return;
+      }
+      char eq = 0;              // quote state as expandattr sees it, which has to agree
+      int s;
+      for (s = 0; s < c->segs && !e; s++)
+      {
+         expandseg_t *g = &c->seg[s],
+            *n = (s + 1 < c->segs ? &c->seg[s + 1] : NULL);
+         if (g->type == EXPANDTEXT)
+         {
+            if (memchr (g->p, '&', g->len))
+               e = -1;          // expanded value has entities processed
+            put (g->p, g->len);
+            eq = g->qend[expandqindex (eq)];
+         } else if (g->type != EXPANDVAR || eq != q || (n && n->type != EXPANDTEXT))
+            e = -1;
+         else if (q == '\'' && qstart + 1 == o && n && *n->p == '\'' && (n->len == 1 || n->p[1] != '\''))
+         {                      // whole '' string, bound as a string
+            o--;
+            q = 0;
+            param (g->p, 1);
+            put (n->p + 1, n->len - 1);
+            eq = n->qend[expandqindex (eq)];
+            s++;
+         } else if (!q && (!n || isspace (*n->p) || *n->p == ')' || *n->p == ','))
+         {                      // unquoted, has to be a value
+            size_t b = o;
+            while (b && isspace (temp.buf[b - 1]))
+               b--;
+            if (!b || !strchr ("=<>(,", temp.buf[b - 1]))
+               e = -1;
+            else
+               param (g->p, 0);
+         } else
+            e = -1;
+      }
+   }
+   xmlattr *att (int id)
+   {                            // attribute if it has a non empty value, as ex() in dosql
+      xmlattr *a = findatt (x, id);
+      if (!a || !a->value || (!*a->value && a->expand == &expandconst))
+         return NULL;
+      return a;
+   }
+   xmlattr *litquery = att (ATT_QUERY);
+   if (litquery)
+      add (litquery, 1);
+   else
+   {
+      xmlattr *select = att (ATT_SELECT),
+         *table = findatt (x, ATT_TABLE),
+         *where = att (ATT_WHERE),
+         *key = findatt (x, ATT_KEY),
+         *group = findatt (x, ATT_GROUP),
+         *having = att (ATT_HAVING),
+         *order = findatt (x, ATT_ORDER),
+         *limit = att (ATT_LIMIT);
+      if (!table || !table->value)
+         table = findatt (x, ATT_FROM);
+      if (!group || !group->value)
+         group = findatt (x, ATT_GROUPBY);
+      if (!order || !order->value)
+         order = findatt (x, ATT_ORDERBY);
+      if (table && (!table->value || (!*table->value && table->expand == &expandconst)))
+         table = NULL;
+      if (group && (!group->value || (!*group->value && group->expand == &expandconst)))
+         group = NULL;
+      if (order && (!order->value || (!*order->value && order->expand == &expandconst)))
+         order = NULL;
+      put ("SELECT ", 7);
+      if (findatt (x, ATT_DISTINCT))
+         put ("DISTINCT ", 9);
+      if (select)
+         add (select, 0);
+      else
+         put ("*", 1);
+      if (table)
+      {
+         put (" FROM ", 6);
+         add (table, 0);
+      }
+      if (where)
+      {
+         put (" WHERE ", 7);
+         add (where, 1);
+      } else if (key && key->value)
+      {
+         put (" WHERE ", 7);
+         put (key->value, strlen (key->value));
+         put ("=", 1);
+         char *v = strrchr (key->value, '.');
+         param (v ? : key->value, 2);
+      }
+      if (group)
+      {
+         put (" GROUP BY ", 10);
+         add (group, 0);
+      }
+      if (having)
+      {
+         put (" HAVING ", 8);
+         add (having, 1);
+      }
+      if (order)
+      {
+         put (" ORDER BY ", 10);
+         add (order, 0);
+         if (findatt (x, ATT_DESC))
+            put (" DESC", 5);
+         if (findatt (x, ATT_ASC))
+            put (" ASC", 4);
+      }
+      if (limit)
+      {
+         put (" LIMIT ", 7);
+         add (limit, 0);
+      }
+   }
+   if (e || q)
+      return -1;
+   tempneed (&temp, o + 1)[o] = 0;      // as is, like the text query, no & in expanded values
+   p->query = strdup (temp.buf);
+   if (!p->query)
+      errx (1, "malloc at line %d", __LINE__);
+   return 0;
+}
+
+static int
+sqlprepexact (SQL_RES * m)
+{                               // result columns all come out of the binary protocol as the same text as a text query, so can be prepared
+   if (!m)
+      return 1;                 // no result
+   SQL_FIELD *f = sql_fetch_field (m);
+   unsigned int c,
+     cols = sql_num_fields (m);
+   for (c = 0; c < cols; c++)
+   {
+      if (f[c].flags & ZEROFILL_FLAG)
+         return 0;
+      switch (f[c].type)
+      {
+      case MYSQL_TYPE_TINY:
+      case MYSQL_TYPE_SHORT:
+      case MYSQL_TYPE_LONG:
+      case MYSQL_TYPE_INT24:
+      case MYSQL_TYPE_LONGLONG:
+      case MYSQL_TYPE_YEAR:
+      case MYSQL_TYPE_DECIMAL:
+      case MYSQL_TYPE_NEWDECIMAL:
+      case MYSQL_TYPE_DATE:
+      case MYSQL_TYPE_VARCHAR:
+      case MYSQL_TYPE_VAR_STRING:
+      case MYSQL_TYPE_STRING:
+      case MYSQL_TYPE_ENUM:
+      case MYSQL_TYPE_SET:
+      case MYSQL_TYPE_TINY_BLOB:
+      case MYSQL_TYPE_MEDIUM_BLOB:
+      case MYSQL_TYPE_LONG_BLOB:
+      case MYSQL_TYPE_BLOB:
+         break;
+      case MYSQL_TYPE_DATETIME:
+      case MYSQL_TYPE_TIMESTAMP:
+         if (f[c].decimals)
+            return 0;           // fractional seconds
+         break;
+      default:                 // e.g. FLOAT, DOUBLE, TIME, BIT
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static int
+sqlprepare (SQL * s, sqlprep_t * p)
+{                               // prepare statement for a cached entry, -1 if it cannot be
+   if (sqlprepquery (p->x, p) || !(p->stmt = mysql_stmt_init (s)))
+      return -1;
+   sqlbool_t update = 1;
+   mysql_stmt_attr_set (p->stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &update);
+   SQL_RES *m = NULL;
+   if (mysql_stmt_prepare (p->stmt, p->query, strlen (p->query)) || mysql_stmt_param_count (p->stmt) != p->params
+       || !sqlprepexact (m = mysql_stmt_result_metadata (p->stmt)))
+   {
+      if (debug)
+         info (p->x, "SQL prepare failed: %s\nError:%s", p->query, mysql_stmt_error (p->stmt));
+      if (m)
+         sql_free_result (m);
+      mysql_stmt_close (p->stmt);
+      p->stmt = NULL;
+      return -1;
+   }
+   if (m)
+      sql_free_result (m);
+   return 0;
+}
+
+static int
+sqlprepexec (xmltoken * x, sqlprep_t * p, char stream)
+{                               // run prepared statement, result for level as dosql would, -1 if the query has to be run as text instead
+   if (sqlprepinuse (p))
+      return -1;                // already in use, e.g. recursive INCLUDE
+   int n;
+   MYSQL_BIND b[p->params ? : 1];
+   unsigned long l[p->params ? : 1];
+   long long i[p->params ? : 1];
+   memset (b, 0, sizeof (b));
+   for (n = 0; n < p->params; n++)
+   {
+      char *v = getvar (p->param[n].name, NULL, NULL, NULL);
+      if (!sqlparamok (v, p->param[n].quoted))
+         return -1;
+      v = v ? : "";
+      b[n].buffer_type = MYSQL_TYPE_STRING;
+      b[n].buffer = v;
+      b[n].buffer_length = l[n] = strlen (v);
+      b[n].length = &l[n];
+      if (!p->param[n].quoted)
+      {                         // compared as the literal number in the text query would be, not as a string converted to DOUBLE
+         b[n].buffer_type = MYSQL_TYPE_NEWDECIMAL;      // e.g. 1.5, or too big for an integer
+         if (!strchr (v, '.'))
+         {
+            char *e;
+            errno = 0;
+            i[n] = strtoll (v, &e, 10);
+            if (!errno && !*e)
+            {
+               b[n].buffer_type = MYSQL_TYPE_LONGLONG;
+               b[n].buffer = &i[n];
+               b[n].buffer_length = sizeof (i[n]);
+               b[n].length = NULL;
+            }
+         }
+      }
+   }
+   if ((p->params && mysql_stmt_bind_param (p->stmt, b)) || mysql_stmt_execute (p->stmt)
+       || (!stream && mysql_stmt_store_result (p->stmt)))
+   {                            // e.g. server restarted, prepare again later
+      if (debug)
+         info (x, "SQL%d: %s (prepared)\nError:%s", level, p->query, mysql_stmt_error (p->stmt));
+      mysql_stmt_close (p->stmt);
+      p->stmt = NULL;
+      p->runs = 0;
+      return -1;
+   }
+   info (x, "SQL%d: %s (prepared)", level, p->query);
+   res[level] = mysql_stmt_result_metadata (p->stmt);
+   if (!res[level])
+      return 0;                 // no result
+   if (!sqlprepexact (res[level]))
+   {                            // e.g. table changed since prepared, run as text from now on
+      sql_free_result (res[level]);
+      res[level] = NULL;
+      mysql_stmt_free_result (p->stmt);
+      mysql_stmt_close (p->stmt);
+      p->stmt = NULL;
+      p->failed = 1;
+      return -1;
+   }
+   SQL_FIELD *f = sql_fetch_field (res[level]);
+   unsigned int c,
+     cols = sql_num_fields (res[level]);
+   if (cols != p->cols)
+   {                            // result columns as strings
+      for (c = 0; c < p->cols; c++)
+         free (p->bind[c].buffer);
+      free (p->bind);
+      free (p->len);
+      free (p->null);
+      free (p->row);
+      p->cols = cols;
+      p->bind = calloc (cols, sizeof (*p->bind));
+      p->len = calloc (cols, sizeof (*p->len));
+      p->null = calloc (cols, sizeof (*p->null));
+      p->row = calloc (cols, sizeof (*p->row));
+      if (cols && (!p->bind || !p->len || !p->null || !p->row))
+         errx (1, "malloc at line %d", __LINE__);
+   }
+   for (c = 0; c < cols; c++)
+   {
+      unsigned long want = (stream ? (f[c].length < 1024 ? f[c].length : 1024) : f[c].max_length);
+      if (want < 64)
+         want = 64;
+      MYSQL_BIND *r = &p->bind[c];
+      if (r->buffer_length < want)
+      {
+         free (r->buffer);
+         if (!(r->buffer = malloc (want + 1)))
+            errx (1, "malloc at line %d", __LINE__);
+         r->buffer_length = want;
+      }
+      r->buffer_type = MYSQL_TYPE_STRING;
+      r->length = &p->len[c];
+      r->is_null = &p->null[c];
+   }
+   mysql_stmt_bind_result (p->stmt, p->bind);
+   sqlprepres[level] = p;
+   if (stream)
+   {
+      sqlstream[level] = 1;
+      sqlstreams++;
+   }
+   return 0;
+}
+
+static int
+sqlbatchexact (sqlbatch_t * b, SQL_FIELD * f)
+{                               // the server matches the key column in IN (...) to the keys exactly as we match the text
+   if (f->flags & ZEROFILL_FLAG)
+      return 0;
+   switch (f->type)
+   {
+   case MYSQL_TYPE_TINY:
+   case MYSQL_TYPE_SHORT:
+   case MYSQL_TYPE_LONG:
+   case MYSQL_TYPE_INT24:
+   case MYSQL_TYPE_LONGLONG:
+      {                         // integer, the keys have to be as the server shows an integer, e.g. not 007 or 7.0
+         sqlbatchkey_t *k;
+         for (k = b->keys; k; k = k->nextkey)
+         {
+            const char *p = k->key;
+            if (*p == '-')
+               p++;
+            if (!isdigit (*p) || (*p == '0' && (p[1] || p != k->key)))
+               return 0;
+            const char *d = p;
+            while (isdigit (*p))
+               p++;
+            if (*p || p - d > 18)
+               return 0;
+         }
+         return 1;
+      }
+   case MYSQL_TYPE_VARCHAR:
+   case MYSQL_TYPE_VAR_STRING:
+   case MYSQL_TYPE_TINY_BLOB:
+   case MYSQL_TYPE_MEDIUM_BLOB:
+   case MYSQL_TYPE_LONG_BLOB:
+   case MYSQL_TYPE_BLOB:
+      return b->quoted && f->charsetnr == 63;   // binary, so no case folding or padding
+   default:                    // e.g. DECIMAL 1.5 is 1.50, CHAR is padded, collations fold case
+      return 0;
+   }
+}
+
+static sqlbatch_t *
+sqlbatchmake (xmltoken * x, int o)
+{                               // run the query for a BATCH SQL for all rows of the outer level o, failed set if it cannot be done
+   xmlarena *a = xmlarenanew (0);
+   sqlbatch_t *b = xmlarenaalloc (a, sizeof (*b));
+   b->arena = a;
+   b->x = x;
+   b->failed = 1;
+   b->keyend = &b->keys;
+   b->next = sqlbatches[o];
+   sqlbatches[o] = b;
+   // Key column and variable, from KEY or a WHERE of just column=$var or column='$var'
+   const char *col;
+   int cl;
+   xmlattr *where = findatt (x, ATT_WHERE),
+      *key = findatt (x, ATT_KEY);
+   if (where && where->value && *where->value)
+   {
+      expandcomp_t *c = where->expand;
+      if (key || !c || c == &expandconst || c->segs < 2 || c->segs > 3 || c->seg[0].type != EXPANDTEXT
+          || c->seg[1].type != EXPANDVAR || (c->segs == 3 && c->seg[2].type != EXPANDTEXT))
+         return b;
+      const char *p = c->seg[0].p,
+         *e = p + c->seg[0].len;
+      while (p < e && isspace (*p))
+         p++;
+      col = p;
+      while (p < e && (isalnum (*p) || *p == '_' || *p == '.' || *p == '`'))
+         p++;
+      cl = p - col;
+      while (p < e && isspace (*p))
+         p++;
+      if (!cl || p == e || *p++ != '=')
+         return b;
+      while (p < e && isspace (*p))
+         p++;
+      if (p < e && *p == '\'')
+      {
+         b->quoted = 1;
+         p++;
+      }
+      if (p < e)
+         return b;
+      if (c->segs == 3)
+      {
+         p = c->seg[2].p;
+         e = p + c->seg[2].len;
+      }
+      if (b->quoted && (p == e || *p++ != '\''))
+         return b;
+      while (p < e && isspace (*p))
+         p++;
+      if (p < e)
+         return b;
+      b->var = c->seg[1].p;
+   } else if (key && key->value)
+   {                            // as dosql, WHERE key='value'
+      col = key->value;
+      cl = strlen (col);
+      b->var = strrchr (col, '.') ? : col;
+      b->quoted = 2;
+   } else
+      return b;
+   // Rest of the query has to be the same for every row
+   int bad = 0;
+   char *raw (int id)
+   {
+      xmlattr *a = findatt (x, id);
+      if (!a || !a->value)
+         return NULL;
+      if (a->expand != &expandconst)
+         bad = 1;
+      return a->value;
+   }
+   char *select = raw (ATT_SELECT),
+      *table = raw (ATT_TABLE) ? : raw (ATT_FROM),
+      *order = raw (ATT_ORDER) ? : raw (ATT_ORDERBY);
+   xmlattr *desc = findatt (x, ATT_DESC);
+   if (bad || !table || !*table || (desc && (!order || !*order)) || findatt (x, ATT_QUERY) || findatt (x, ATT_GROUP)
+       || findatt (x, ATT_GROUPBY) || findatt (x, ATT_HAVING) || findatt (x, ATT_LIMIT))
+      return b;
+   int vl = -1;
+   getvar (b->var, NULL, &vl, NULL);
+   if (vl != o)
+      return b;                 // not a field of the outer SQL
+   // Key values from all outer rows
+   int keys = 0;
+   void value (void)
+   {
+      char *v = getvar (b->var, NULL, NULL, NULL);
+      if (!sqlparamok (v, b->quoted))
+         return;                // that row is run on its own
+      v = v ? : "";
+      uint32_t h = namehash (v);
+      sqlbatchkey_t **kp = &b->hash[h % SQLBATCHHASH],
+         *k;
+      while ((k = *kp) && (k->hash != h || strcmp (k->key, v)))
+         kp = &k->next;
+      if (k)
+         return;
+      k = *kp = xmlarenaalloc (a, sizeof (*k));
+      k->hash = h;
+      k->key = xmlarenastrdup (a, v);
+      k->end = &k->row;
+      *b->keyend = k;
+      b->keyend = &k->nextkey;
+      keys++;
+   }
+   SQL_ROW cur = row[o];
+   int n = sqlrows[o];
+   if (sqlbatchres[o])
+   {                            // outer rows are from a batch too
+      sqlbatchrow_t *r;
+      for (r = sqlbatchres[o]->first; r; r = r->next)
+      {
+         row[o] = r->row;
+         value ();
+      }
+   } else if (sqlprepres[o])
+   {                            // fetch all, then fetch the current row again as the buffers are reused
+      mysql_stmt_data_seek (sqlprepres[o]->stmt, 0);
+      while ((row[o] = sqlfetch (o)))
+         value ();
+      mysql_stmt_data_seek (sqlprepres[o]->stmt, n - 1);
+      sqlfetch (o);
+   } else
+   {
+      mysql_data_seek (res[o], 0);
+      while ((row[o] = sql_fetch_row (res[o])))
+         value ();
+      mysql_data_seek (res[o], n);
+   }
+   row[o] = cur;
+   sqlrows[o] = n;
+   if (!keys)
+      return b;
+   // Queries
+   SQL *s = sqlconn ();
+   b->res = xmlarenaalloc (a, (keys + SQLBATCHCHUNK - 1) / SQLBATCHCHUNK * sizeof (*b->res));
+   int unmatched = 0;
+   TEMP (temp);
+   sqlbatchkey_t *k = b->keys;
+   while (k)
+   {
+      char *query;
+      size_t l;
+      FILE *f = open_memstream (&query, &l);
+      fprintf (f, "SELECT ");
+      if (findatt (x, ATT_DISTINCT))
+         fprintf (f, "DISTINCT ");
+      fprintf (f, "%s,%.*s FROM %s WHERE %.*s IN (", select && *select ? select : "*", cl, col, table, cl, col);
+      for (n = 0; k && n < SQLBATCHCHUNK; n++, k = k->nextkey)
+      {
+         if (n)
+            fputc (',', f);
+         if (b->quoted)
+         {
+            size_t kl = strlen (k->key);
+            char *e = tempneed (&temp, kl * 2 + 1);
+            mysql_real_escape_string (s, e, k->key, kl);
+            fprintf (f, "'%s'", e);
+         } else
+            fprintf (f, "%s", k->key);
+      }
+      fprintf (f, ")");
+      if (order && *order)
+      {
+         fprintf (f, " ORDER BY %s", order);
+         if (desc)
+            fprintf (f, " DESC");
+         if (findatt (x, ATT_ASC))
+            fprintf (f, " ASC");
+      }
+      fclose (f);
+      if (sql_query (s, query))
+      {
+         warning (x, "SQL%d: %s\nError:%s", level, query, (char *) sql_error (s));
+         free (query);
+         return b;
+      }
+      info (x, "SQL%d: %s", level, query);
+      free (query);
+      SQL_RES *r = sql_store_result (s);
+      if (!r)
+         return b;
+      b->res[b->results++] = r;
+      unsigned int kf = sql_num_fields (r) - 1;        // the key column added at the end
+      if (b->results == 1 && !sqlbatchexact (b, &sql_fetch_field (r)[kf]))
+      {
+         info (x, "SQL%d: batch not used, key column type does not match keys as text", level);
+         return b;
+      }
+      SQL_ROW rr;
+      while ((rr = sql_fetch_row (r)))
+      {                         // rows by key, in order
+         if (!rr[kf])
+            continue;
+         uint32_t h = namehash (rr[kf]);
+         sqlbatchkey_t *q;
+         for (q = b->hash[h % SQLBATCHHASH]; q && (q->hash != h || strcmp (q->key, rr[kf])); q = q->next);
+         if (!q)
+         {                      // not exact match, so the server matched differently to us
+            unmatched++;
+            continue;
+         }
+         sqlbatchrow_t *br = xmlarenaalloc (a, sizeof (*br));
+         br->row = rr;
+         *q->end = br;
+         q->end = &br->next;
+      }
+   }
+   if (unmatched)
+   {
+      info (x, "SQL%d: batch not used, %d rows did not match a key", level, unmatched);
+      return b;
+   }
+   b->failed = 0;
+   return b;
+}
+
+static int
+sqlbatch (xmltoken * x)
+{                               // rows for a BATCH SQL from a query done once for all rows of the outer SQL, -1 if it has to be run on its own
+   int o = level - 1;
+   if (o < 0 || sqlactive[o] != 1 || !res[o] || sqlstream[o])
+      return -1;
+   sqlbatch_t *b;
+   for (b = sqlbatches[o]; b && b->x != x; b = b->next);
+   if (!b)
+      b = sqlbatchmake (x, o);
+   if (b->failed)
+      return -1;
+   char *v = getvar (b->var, NULL, NULL, NULL);
+   if (!sqlparamok (v, b->quoted))
+      return -1;
+   v = v ? : "";
+   uint32_t h = namehash (v);
+   sqlbatchkey_t *k;
+   for (k = b->hash[h % SQLBATCHHASH]; k && (k->hash != h || strcmp (k->key, v)); k = k->next);
+   if (!k)
+      return -1;                // e.g. outer rows changed
+   b->first = b->pos = k->row;
+   res[level] = b->res[0];
+   sqlbatchres[level] = b;
+   info (x, "SQL%d: batch %s", level, v);
+   return 0;
+}
+
+static void *
+sqlparallelrun (void *arg)
+{                               // thread running every sqlparthreads'th parallel query on its own connection
+   int t = (intptr_t) arg,
+      n;
+   MYSQL *m = &sqlpar[t];
+   mysql_thread_init ();
+   for (n = t; n < sqlparallels; n += sqlparthreads)
+   {
+      sqlparallel_t *q = &sqlparallel[n];
+      SQL_RES *r = NULL;
+      char *e = NULL;
+      if (mysql_real_query (m, q->query, strlen (q->query)) || (!(r = mysql_store_result (m)) && mysql_errno (m)))
+         e = strdup (mysql_error (m) ? : "?");
+      pthread_mutex_lock (&sqlparmutex);
+      q->res = r;
+      q->error = e;
+      q->done = 1;
+      pthread_cond_broadcast (&sqlparcond);
+      pthread_mutex_unlock (&sqlparmutex);
+   }
+   mysql_thread_end ();
+   return NULL;
+}
+
+void
+sqlparallelstart (xmltoken * x)
+{                               // start top level SQL whose query is constant, up to anything that may change the database
+   xmltoken *t;
+   for (t = x; t && sqlparallels < SQLPARALLELMAX; t = t->next)
+   {
+      if (!(t->type & XML_START))
+         continue;
+      if (t->tag == TAG_INCLUDE || t->tag == TAG_EXEC)
+         break;                 // could do anything
+      if (t->tag != TAG_SQL)
+         continue;
+      char *q = getatt (t, ATT_QUERY);
+      if (q)
+      {
+         while (isspace (*q))
+            q++;
+         if (strncasecmp (q, "SELECT", 6) || isalnum (q[6]) || q[6] == '_')
+            break;              // may change things later queries see
+      }
+      if (t->level || !t->end || findatt (t, ATT_BATCH) || findatt (t, ATT_MEMO) || findatt (t, ATT_CACHE))
+         continue;              // may not run, or not run as a simple query
+      sqlprep_t p = {.x = t };
+      if (!sqlprepquery (t, &p) && !p.params)
+         sqlparallel[sqlparallels++] = (sqlparallel_t) {.x = t,.query = p.query };
+      else
+         free (p.query);
+      free (p.param);
+   }
+   if (!sqlparallels)
+      return;
+   sqlparthreads = (parallelsql < sqlparallels ? parallelsql : sqlparallels);
+   if (sqlparthreads > SQLPARALLELMAX)
+      sqlparthreads = SQLPARALLELMAX;
+   int n;
+   for (n = 0; n < sqlparthreads; n++)
+   {
+      if (!sqlparconnected[n])
+      {
+         sql_real_connect (&sqlpar[n], sqlhost, sqluser, sqlpass, sqldatabase, sqlport, 0, 0, 1, sqlconf);
+         sqlparconnected[n] = 1;
+      }
+      if (pthread_create (&sqlparthread[n], NULL, sqlparallelrun, (void *) (intptr_t) n))
+         errx (1, "pthread_create failed");
+   }
+}
+
+static sqlparallel_t *
+sqlparalleltake (xmltoken * x, const char *query)
+{                               // parallel query for this SQL, once the thread has run it, NULL if none
+   int n;
+   for (n = 0; n < sqlparallels && sqlparallel[n].x != x; n++);
+   if (n == sqlparallels || !sqlparallel[n].query)
+      return NULL;
+   sqlparallel_t *q = &sqlparallel[n];
+   pthread_mutex_lock (&sqlparmutex);
+   while (!q->done)
+      pthread_cond_wait (&sqlparcond, &sqlparmutex);
+   pthread_mutex_unlock (&sqlparmutex);
+   int same = !strcmp (q->query, query);
+   free (q->query);
+   q->query = NULL;             // used
+   if (same)
+      return q;
+   if (q->res)
+      sql_free_result (q->res);
+   q->res = NULL;
+   return NULL;
+}
+
+void
+sqlparalleldone (void)
+{                               // wait for parallel queries and free any not used
+   int n;
+   for (n = 0; n < sqlparthreads; n++)
+      pthread_join (sqlparthread[n], NULL);
+   for (n = 0; n < sqlparallels; n++)
+   {
+      if (sqlparallel[n].res)
+         sql_free_result (sqlparallel[n].res);
+      free (sqlparallel[n].query);
+      free (sqlparallel[n].error);
+   }
+   sqlparallels = sqlparthreads = 0;
 }
 
 xmltoken *
@@ -2842,211 +5304,303 @@ dosql (xmltoken * x, process_t * state)
       warning (x, "SQL nested too deep");
       return x->next;
    }
-   if (!sqlconnected)
-   {
-      sql_real_connect (&sql, sqlhost, sqluser, sqlpass, sqldatabase, sqlport, 0, 0, 1, sqlconf);
-      sqlconnected = 1;
+   int c = sqlstreams;          // connection sqlconn uses
+   SQL *s = NULL;
+   SQL *conn (void)
+   {                            // connect only when a query has to go to the server, not for batch, memo, cache or parallel results
+      if (!s)
+         s = sqlconn ();
+      return s;
    }
-   if (sqlconnected)
    {
       {                         // construct query
-         char *litquery = getatt (x, "QUERY");
-         xmlattr *key = xmlfindattr (x, "KEY");
-         char *select = getatt (x, "SELECT");
-         char *table = getatt (x, "TABLE");
-         char *where = getatt (x, "WHERE");
-         char *order = getatt (x, "ORDER");
-         char *having = getatt (x, "HAVING");
-         char *group = getatt (x, "GROUP");
-         char *limit = getatt (x, "LIMIT");
-         xmlattr *csv = xmlfindattr (x, "CSV");
-         xmlattr *csvhead = xmlfindattr (x, "CSVHEAD");
-         xmlattr *xml = xmlfindattr (x, "XML");
-         xmlattr *json = xmlfindattr (x, "JSON");
-         xmlattr *jsarray = xmlfindattr (x, "JSARRAY");
-         xmlattr *jsarrayhead = xmlfindattr (x, "JSARRAYHEAD");
-         xmlattr *tablehead = xmlfindattr (x, "TABLEHEAD");
-         xmlattr *tablerow = xmlfindattr (x, "TABLEROW");
+         char *litquery = getatt (x, ATT_QUERY);
+         xmlattr *key = findatt (x, ATT_KEY);
+         char *select = getatt (x, ATT_SELECT);
+         char *table = getatt (x, ATT_TABLE);
+         char *where = getatt (x, ATT_WHERE);
+         char *order = getatt (x, ATT_ORDER);
+         char *having = getatt (x, ATT_HAVING);
+         char *group = getatt (x, ATT_GROUP);
+         char *limit = getatt (x, ATT_LIMIT);
+         xmlattr *csv = findatt (x, ATT_CSV);
+         xmlattr *csvhead = findatt (x, ATT_CSVHEAD);
+         xmlattr *xml = findatt (x, ATT_XML);
+         xmlattr *json = findatt (x, ATT_JSON);
+         xmlattr *jsarray = findatt (x, ATT_JSARRAY);
+         xmlattr *jsarrayhead = findatt (x, ATT_JSARRAYHEAD);
+         xmlattr *tablehead = findatt (x, ATT_TABLEHEAD);
+         xmlattr *tablerow = findatt (x, ATT_TABLEROW);
          if ((json && json->value) || (jsarray && jsarray->value) || (tablerow && tablerow->value))
             out = open_memstream (&outdata, &outsize);
-         char temp[MAXTEMP];
+         TEMP (temp);
+         TEMP (stattemp);
+         double t0 = (sqltiming ? monotime () : 0),
+            tq = 0;
+         const char *sq = NULL; // query for slow query log
          char *v;
          char *query = NULL;
-         xmlattr *desc = xmlfindattr (x, "DESC");
-         xmlattr *asc = xmlfindattr (x, "ASC");
-         xmlattr *distinct = xmlfindattr (x, "DISTINCT");
+         xmlattr *desc = findatt (x, ATT_DESC);
+         xmlattr *asc = findatt (x, ATT_ASC);
+         xmlattr *distinct = findatt (x, ATT_DISTINCT);
          if (!table)
-            table = getatt (x, "FROM");
+            table = getatt (x, ATT_FROM);
          if (!group)
-            group = getatt (x, "GROUPBY");
+            group = getatt (x, ATT_GROUPBY);
          if (!order)
-            order = getatt (x, "ORDERBY");
-         if (litquery)
-         {                      // literal query
-            if (key)
-               warning (x, "QUERY and KEY in SQL");
-            if (select)
-               warning (x, "QUERY and SELECT in SQL");
-            if (table)
-               warning (x, "QUERY and TABLE in SQL");
-            if (where)
-               warning (x, "QUERY and WHERE in SQL");
-            if (order)
-               warning (x, "QUERY and ORDER in SQL");
-            if (having)
-               warning (x, "QUERY and HAVING in SQL");
-            if (group)
-               warning (x, "QUERY and GROUP in SQL");
-            if (limit)
-               warning (x, "QUERY and LIMIT in SQL");
-            if (desc)
-               warning (x, "QUERY and DESC in SQL");
-            if (asc)
-               warning (x, "QUERY and ASC in SQL");
-            v = expand (temp, sizeof (temp), litquery);
-            if (!v)
-               warnx ("Failed to expand: %s", litquery);
-            query = strdup (v);
-         } else
-         {                      // construct query
-            if (key && key->value && where && *where)
-            {
-               warning (x, "KEY and WHERE in SQL");
-               return x->end->next;
-            };
-            if (desc && (!order || !*order))
-            {
-               warning (x, "DESC with no ORDER in SQL");
-               return x->end->next;
-            };
-            char *exp (char *p)
-            {
-               if (!p)
-                  return NULL;
-               p = expand (temp, sizeof (temp), p);
-               if (!*p)
-                  return NULL;
-               return p;
-            }
-#define ex(n) (n=exp(n))
-            // Construct then expand
-            size_t l;
-            FILE *o = open_memstream (&query, &l);
-            fprintf (o, "SELECT ");
-            if (distinct)
-               fprintf (o, "DISTINCT ");
-            fprintf (o, "%s", ex (select) ? : "*");
-            if (ex (table))
-               fprintf (o, " FROM %s", table);
-            if (ex (where))
-               fprintf (o, " WHERE %s", where);
-            else if (key && key->value)
-            {
-               char *v = strrchr (key->value, '.');
-               v = getvar (v ? : key->value, NULL, NULL, NULL);
-               fprintf (o, " WHERE %s='%s'", key->value, v ? : "");
-            }
-            if (ex (group))
-               fprintf (o, " GROUP BY %s", group);
-            if (ex (having))
-               fprintf (o, " HAVING %s", having);
-            if (ex (order))
-            {
-               fprintf (o, " ORDER BY %s", order);
+            order = getatt (x, ATT_ORDERBY);
+         char stream = 0;
+         if (x->type & XML_END)
+            stream = (csv || xml || json || jsarray || tablerow);       // direct output, nothing else queried while reading rows
+         else if (findatt (x, ATT_STREAM))
+            stream = 1;         // queries in the content use another connection
+         xmlattr *memo = findatt (x, ATT_MEMO);
+         xmlattr *cache = findatt (x, ATT_CACHE);
+         int ttl = 0;
+         if (cache && cache->value && cachedir)
+            ttl = atoi (expandx (&temp, x, cache->value) ? : "");
+         if (memo || ttl > 0)
+            stream = 0;         // result is kept
+         sqlprep_t **pp = sqlprepfind (x, c),
+            *p = *pp;
+         int e = -1;
+         if (findatt (x, ATT_BATCH))
+            e = sqlbatch (x);
+         if (e < 0 && !memo && ttl <= 0 && p && !p->stmt && !p->failed && p->runs && sqlprepare (conn (), p))
+            p->failed = 1;      // run as text from now on
+         if (e < 0 && !memo && ttl <= 0 && p && p->stmt)
+         {
+            e = sqlprepexec (x, p, stream);
+            sq = p->query;
+         }
+         if (e < 0)
+         {                      // text query
+            if (litquery)
+            {                   // literal query
+               if (key)
+                  warning (x, "QUERY and KEY in SQL");
+               if (select)
+                  warning (x, "QUERY and SELECT in SQL");
+               if (table)
+                  warning (x, "QUERY and TABLE in SQL");
+               if (where)
+                  warning (x, "QUERY and WHERE in SQL");
+               if (order)
+                  warning (x, "QUERY and ORDER in SQL");
+               if (having)
+                  warning (x, "QUERY and HAVING in SQL");
+               if (group)
+                  warning (x, "QUERY and GROUP in SQL");
+               if (limit)
+                  warning (x, "QUERY and LIMIT in SQL");
                if (desc)
-                  fprintf (o, " DESC");
+                  warning (x, "QUERY and DESC in SQL");
                if (asc)
-                  fprintf (o, " ASC");
-            }
-            if (ex (limit))
-               fprintf (o, " LIMIT %s", limit);
-            fclose (o);
-         }
-#undef qadd
-         {                      // Sanity check
-            char q = 0;
-            char *p;
-            for (p = query; *p; p++)
-            {
-               if (*p == '\\' && p[1])
+                  warning (x, "QUERY and ASC in SQL");
+               v = expandx (&temp, x, litquery);
+               if (!v)
+                  warnx ("Failed to expand: %s", litquery);
+               query = strdup (v);
+            } else
+            {                   // construct query
+               if (key && key->value && where && *where)
                {
-                  if (!p[1])
-                     errx (1, "%s:%d Trailing \\ in SQL query: %s", x->filename, x->line, query);
-                  p++;
-                  continue;
+                  warning (x, "KEY and WHERE in SQL");
+                  return x->end->next;
+               };
+               if (desc && (!order || !*order))
+               {
+                  warning (x, "DESC with no ORDER in SQL");
+                  return x->end->next;
+               };
+               char *exp (char *p)
+               {
+                  if (!p)
+                     return NULL;
+                  p = expandx (&temp, x, p);
+                  if (!*p)
+                     return NULL;
+                  return p;
+               }
+   #define ex(n) (n=exp(n))
+               // Construct then expand
+               size_t l;
+               FILE *o = open_memstream (&query, &l);
+               fprintf (o, "SELECT ");
+               if (distinct)
+                  fprintf (o, "DISTINCT ");
+               fprintf (o, "%s", ex (select) ? : "*");
+               if (ex (table))
+                  fprintf (o, " FROM %s", table);
+               if (ex (where))
+                  fprintf (o, " WHERE %s", where);
+               else if (key && key->value)
+               {
+                  char *v = strrchr (key->value, '.');
+                  v = getvar (v ? : key->value, NULL, NULL, NULL);
+                  fprintf (o, " WHERE %s='%s'", key->value, v ? : "");
+               }
+               if (ex (group))
+                  fprintf (o, " GROUP BY %s", group);
+               if (ex (having))
+                  fprintf (o, " HAVING %s", having);
+               if (ex (order))
+               {
+                  fprintf (o, " ORDER BY %s", order);
+                  if (desc)
+                     fprintf (o, " DESC");
+                  if (asc)
+                     fprintf (o, " ASC");
                }
-               if (q && *p == q)
-                  q = 0;
-               else if (!q && (*p == '`' || *p == '\'' || *p == '"'))
-                  q = *p;
-               if (!q)
+               if (ex (limit))
+                  fprintf (o, " LIMIT %s", limit);
+               fclose (o);
+            }
+   #undef qadd
+            {                   // Sanity check
+               char q = 0;
+               char *p;
+               for (p = query; *p; p++)
                {
-                  if ((*p == '-' && p[1] == '-' && (!p[2] || isspace (p[2]))) || *p == '#' || (*p == '/' && p[1] == '*'))
-                     errx (1, "%s:%d Comment in SQL query: %s", x->filename, x->line, query);
-                  if (*p == ';')
+                  if (*p == '\\' && p[1])
                   {
                      if (!p[1])
+                        errx (1, "%s:%d Trailing \\ in SQL query: %s", x->filename, x->line, query);
+                     p++;
+                     continue;
+                  }
+                  if (q && *p == q)
+                     q = 0;
+                  else if (!q && (*p == '`' || *p == '\'' || *p == '"'))
+                     q = *p;
+                  if (!q)
+                  {
+                     if ((*p == '-' && p[1] == '-' && (!p[2] || isspace (p[2]))) || *p == '#' || (*p == '/' && p[1] == '*'))
+                        errx (1, "%s:%d Comment in SQL query: %s", x->filename, x->line, query);
+                     if (*p == ';')
                      {
-                        *p = 0;
-                        warnx ("%s:%d Trailing ; on sql query, ignored: %s", x->filename, x->line, query);
-                     } else
-                        errx (1, "%s:%d Multiple query attempt in SQL query: %s", x->filename, x->line, query);
+                        if (!p[1])
+                        {
+                           *p = 0;
+                           warnx ("%s:%d Trailing ; on sql query, ignored: %s", x->filename, x->line, query);
+                        } else
+                           errx (1, "%s:%d Multiple query attempt in SQL query: %s", x->filename, x->line, query);
+                     }
                   }
                }
+               if (q)
+                  errx (1, "%s:%d Unclosed (%c) in query: %s", x->filename, x->line, q, query);
+            }
+            if (sqltiming)
+            {
+               size_t l = strlen (query) + 1;
+               sq = memcpy (tempneed (&stattemp, l), query, l);
+            }
+            sqlmemo_t *m = NULL;
+            sqlparallel_t *r = NULL;
+            if (sqlparallels && (r = sqlparalleltake (x, query)))
+            {                   // run when the script started
+               if (r->error)
+               {
+                  warning (x, "SQL%d: %s\nError:%s", level, query, r->error);
+                  free (query);
+                  return x->end->next;
+               }
+               info (x, "SQL%d: %s (parallel)", level, query);
+               res[level] = r->res;
+               r->res = NULL;
+               free (query);
+            } else if (memo && (m = sqlmemofind (query)) && !sqlmemoinuse (m))
+            {                   // same query already run
+               info (x, "SQL%d: %s (memo)", level, query);
+               sqlmemohits++;
+               mysql_data_seek (m->res, 0);
+               res[level] = m->res;
+               sqlmemores[level] = m;
+               free (query);
+            } else if (ttl > 0 && (sqlcacheres[level] = sqlcacheload (query)))
+            {                   // run recently, maybe by another process
+               info (x, "SQL%d: %s (cached)", level, query);
+               free (query);
+            } else
+            {
+               if (sql_query (conn (), query))
+               {
+                  warning (x, "SQL%d: %s\nError:%s", level, query, (char *) sql_error (s));
+                  free (query);
+                  return x->end->next;
+               } else
+                  info (x, "SQL%d: %s", level, query);
+               if (sqltiming)
+                  tq = monotime ();
+               if (stream)
+               {                // rows fetched as we go, not all held in memory
+                  res[level] = sql_use_result (s);
+                  if (res[level])
+                  {
+                     sqlstream[level] = 1;
+                     sqlstreams++;
+                  }
+               } else
+                  res[level] = sql_store_result (s);
+               if (ttl > 0 && res[level])
+                  sqlcachesave (query, res[level], ttl);
+               if (memo)
+               {
+                  sqlmemomisses++;
+                  if (res[level] && !m && (m = sqlmemoadd (query, res[level])))
+                     sqlmemores[level] = m;
+               }
+               free (query);
+               if (!p)
+               {                // note it has run, prepared if it runs again
+                  if (sqlpreps >= SQLPREPMAX)
+                  {
+                     sqlprepforget (NULL, -1);
+                     pp = sqlprepfind (x, c);
+                  }
+                  if (!(p = calloc (1, sizeof (*p))))
+                     errx (1, "malloc at line %d", __LINE__);
+                  p->x = x;
+                  p->conn = c;
+                  *pp = p;
+                  sqlpreps++;
+               }
+               p->runs++;
             }
-            if (q)
-               errx (1, "%s:%d Unclosed (%c) in query: %s", x->filename, x->line, q, query);
          }
-         if (sql_query (&sql, query))
+         if (!res[level] && !sqlcacheres[level] && sqlmemobytes)
+            sqlmemoflush ();    // may have changed something
+         double tf = 0;
+         long long o0 = 0;
+         if (sqltiming)
+         {
+            tf = monotime ();
+            if (!tq)
+               tq = tf;
+            o0 = outpos (out);
+         }
+         if (sqlcacheres[level])
+         {
+            fields[level] = sqlcacheres[level]->fields;
+            field[level] = sqlcacheres[level]->field;
+         } else if (res[level])
          {
-            warning (x, "SQL%d: %s\nError:%s", level, query, (char *) sql_error (&sql));
-            free (query);
-            return x->end->next;
-         } else
-            info (x, "SQL%d: %s", level, query);
-         //res[level] = sql_use_result (&sql);
-         res[level] = sql_store_result (&sql);
-         free (query);
-         if (res[level])
-         {                      // query done, result
             fields[level] = sql_num_fields (res[level]);
+            if (sqlbatchres[level])
+               fields[level]--; // key column added for BATCH
             field[level] = sql_fetch_field (res[level]);
+         }
+         if (res[level] || sqlcacheres[level])
+         {                      // query done, result
             void xmlout (char *c)
             {
-               if (!c)
-                  return;
-               while (*c)
-               {
-                  if (*c == '\n' || (*c == '\r' && v[1] != '\n'))
-                     fprintf (out, "<br>");
-                  else if (*c == '\f')
-                     fprintf (out, "<br><hr>");
-                  //else if (*c == (char) 160) fprintf (out, "&nbsp;");
-                  else if (*c == '\'')
-                     fprintf (out, "&#39;");    //apos does not work in IE Except xml
-                  else if (*c == '&')
-                     fprintf (out, "&amp;");
-                  else if (*c == '<')
-                     fprintf (out, "&lt;");
-                  else if (*c == '>')
-                     fprintf (out, "&gt;");
-                  else if (*c != '\r')
-                     fputc (*c, out);
-                  c++;
-               }
+               if (c)
+                  escputs (out, ESC_HTML, c);
             }
             void csvout (const char *p, char q)
-            {                   // JSON string
-               while (*p)
-               {
-                  if (*p >= ' ')
-                  {
-                     if ((q && *p == q) || *p == '\\')
-                        fputc ('\\', out);
-                     fputc (*p, out);
-                  }
-                  p++;
-               }
+            {                   // CSV string, q is quote used, if any
+               escputs (out, q ? ESC_CSV : ESC_CSVNUM, p);
             }
             void jsonout (const char *p)
             {                   // JSON string
@@ -3056,25 +5610,7 @@ dosql (xmltoken * x, process_t * state)
                   return;
                }
                fputc ('"', out);
-               while (*p)
-               {
-                  unsigned char c = *p;
-                  if (c == '\n')
-                     fprintf (out, "\\n");
-                  else if (c == '\r')
-                     fprintf (out, "\\r");
-                  else if (c == '\t')
-                     fprintf (out, "\\t");
-                  else if (c == '\b')
-                     fprintf (out, "\\b");
-                  else if (c == '\\' || c == '"' || c == '/')   // Note escaping / is optional but done to avoid </script> issues
-                     fprintf (out, "\\%c", (char) c);
-                  else if (c < ' ')
-                     fprintf (out, "\\u%04X", c);
-                  else
-                     fputc (c, out);
-                  p++;
-               }
+               escputs (out, ESC_JSON, p);
                fputc ('"', out);
             }
             if (tablehead)
@@ -3104,7 +5640,7 @@ dosql (xmltoken * x, process_t * state)
             {                   // command has results, and we have no way to format it - special cases for direct formatted output
                if (csv)
                {                // Direct CSV output
-                  while ((row[level] = sql_fetch_row (res[level])))
+                  while ((row[level] = sqlfetch (level)))
                   {
                      for (int f = 0; f < fields[level]; f++)
                      {
@@ -3127,7 +5663,7 @@ dosql (xmltoken * x, process_t * state)
                   }
                } else if (xml)
                {                // Direct XML output
-                  while ((row[level] = sql_fetch_row (res[level])))
+                  while ((row[level] = sqlfetch (level)))
                   {
                      fprintf (out, "<%s>", xml->value ? : "Row");
                      for (int f = 0; f < fields[level]; f++)
@@ -3182,7 +5718,7 @@ dosql (xmltoken * x, process_t * state)
                      }
                      fprintf (out, "]");
                   }
-                  while ((row[level] = sql_fetch_row (res[level])))
+                  while ((row[level] = sqlfetch (level)))
                   {
                      if (found++)
                         fprintf (out, ",");
@@ -3224,7 +5760,7 @@ dosql (xmltoken * x, process_t * state)
                   fprintf (out, "]");
                } else if (tablerow)
                {                // Simple table rows
-                  while ((row[level] = sql_fetch_row (res[level])))
+                  while ((row[level] = sqlfetch (level)))
                   {
                      fprintf (out, "<tr class='sqlresult'>");
                      for (int f = 0; f < fields[level]; f++)
@@ -3256,7 +5792,7 @@ dosql (xmltoken * x, process_t * state)
                   }
                } else
                {
-                  sql_free_result (res[level]);
+                  sqlfree (level);
                   warning (x, "SQL result with no formatting");
                   return x->end->next;
                }
@@ -3264,38 +5800,39 @@ dosql (xmltoken * x, process_t * state)
             {                   // command has results, and we have content to output using that
                if (csv)
                {
-                  sql_free_result (res[level]);
+                  sqlfree (level);
                   warning (x, "SQL CSV - use self closing SQL tag");
                   return x->end->next;
                }
                if (xml)
                {
-                  sql_free_result (res[level]);
+                  sqlfree (level);
                   warning (x, "SQL XML - use self closing SQL tag");
                   return x->end->next;
                }
                if (json || jsarray)
                {
-                  sql_free_result (res[level]);
+                  sqlfree (level);
                   warning (x, "SQL JSON - use self closing SQL tag");
                   return x->end->next;
                }
                if (tablerow)
                {
-                  sql_free_result (res[level]);
+                  sqlfree (level);
                   warning (x, "SQL TABLE - use self closing SQL tag");
                   return x->end->next;
                }
-               row[level] = sql_fetch_row (res[level]);
+               row[level] = sqlfetch (level);
                if (row[level])
                {
+                  fieldindex (level);
                   sqlactive[level] = 1;
                   do
                   {
                      level++;
                      processxml (x->next, x->end, state);
                      level--;
-                     row[level] = sql_fetch_row (res[level]);
+                     row[level] = sqlfetch (level);
                   }
                   while (row[level]);
                   info (x, "SQL%d: done", level);
@@ -3303,16 +5840,25 @@ dosql (xmltoken * x, process_t * state)
                {                // no rows
                   if (key && table)
                   {             // template
-                     sql_free_result (res[level]);
-                     res[level] = sql_list_fields (&sql, table, 0);
+                     sqlfree (level);
+                     schema_t *c = schemafind (sqldatabase, table, NULL);
+                     if (c && !c->res)
+                        c->res = sql_list_fields (conn (), table, 0);
+                     if (c)
+                     {
+                        res[level] = c->res;
+                        schemares[level] = c;
+                     } else
+                        res[level] = sql_list_fields (conn (), table, 0);
                      if (!res[level])
                      {
-                        sql_free_result (res[level]);
+                        sqlfree (level);
                         warning (x, "SQL query with no content - use self closing SQL tag");
                         return x->end->next;
                      }
                      field[level] = sql_fetch_field (res[level]);
                      fields[level] = sql_num_fields (res[level]);
+                     fieldindex (level);
                      sqlactive[level] = 2;
                      level++;
                      processxml (x->next, x->end, state);
@@ -3323,9 +5869,13 @@ dosql (xmltoken * x, process_t * state)
                }
                sqlactive[level] = 0;
             }
-            sql_free_result (res[level]);
+            if (sqltiming)
+               sqltime (x, sq, t0, tq, tf, sqlrows[level], outpos (out) - o0);
+            sqlfree (level);
          } else
          {                      // command done, no result
+            if (sqltiming)
+               sqltime (x, sq, t0, tq, tf, 0, 0);
             if (!(x->type & XML_END))
                warning (x, "SQL command with content produced no results - use self closing SQL tag");
             return x->end->next;
@@ -3336,13 +5886,13 @@ dosql (xmltoken * x, process_t * state)
             fclose (out);
             char *tag = NULL;
             if (json && json->value)
-               tag = expand (temp, sizeof (temp), json->value);
+               tag = expand (&temp, json->value);
             else if (jsarray && jsarray->value)
-               tag = expand (temp, sizeof (temp), jsarray->value);
+               tag = expand (&temp, jsarray->value);
             else if (tablerow && tablerow->value)
-               tag = expand (temp, sizeof (temp), tablerow->value);
+               tag = expand (&temp, tablerow->value);
             if (tag && *tag)
-               setenv (tag, outdata, 1);
+               varset (tag, outdata);
             free (outdata);
          }
       }
@@ -3353,38 +5903,38 @@ dosql (xmltoken * x, process_t * state)
 xmltoken *
 doinput (xmltoken * x, process_t * state)
 {                               // do input function
-   char *name = getatt (x, "name");
-   char *value = getatt (x, "value");
-   char *set = getatt (x, "set");
+   char *name = getatt (x, ATT_NAME);
+   char *value = getatt (x, ATT_VALUE);
+   char *set = getatt (x, ATT_SET);
    char *checkval = value;
-   char *type = getatt (x, "type");
-   char *size = getatt (x, "size");
-   char *style = getatt (x, "style");
-   char *class = getatt (x, "class");
-   char *maxlength = getatt (x, "maxlength");
-   char *checked = getatt (x, "checked");
-   xmlattr *trim = xmlfindattr (x, "TRIM");
+   char *type = getatt (x, ATT_TYPE);
+   char *size = getatt (x, ATT_SIZE);
+   char *style = getatt (x, ATT_STYLE);
+   char *class = getatt (x, ATT_CLASS);
+   char *maxlength = getatt (x, ATT_MAXLENGTH);
+   char *checked = getatt (x, ATT_CHECKED);
+   xmlattr *trim = findatt (x, ATT_TRIM);
    char *v = 0;
    char tsize[50];
    char tmaxlength[30];
-   char tempvar[100];
+   TEMP (tempvar);
    int len = 0;
    if (value)
    {                            // Allow $ in explicit value
-      char temp[1000];
-      value = strdupa (expand (temp, sizeof (temp), value));
+      TEMP (temp);
+      value = strdupa (expandx (&temp, x, value));
    }
    if (style)
    {                            // Allow $ in explicit style
-      char temp[1000];
-      style = strdupa (expand (temp, sizeof (temp), style));
+      TEMP (temp);
+      style = strdupa (expandx (&temp, x, style));
    }
    if (!type)
       type = XMLATTREMOVE;
    else
    {
-      char temp[100];
-      type = strdupa (expand (temp, sizeof (temp), type));
+      TEMP (temp);
+      type = strdupa (expandx (&temp, x, type));
    }
    if (!checked)
       checked = XMLATTREMOVE;
@@ -3414,9 +5964,9 @@ doinput (xmltoken * x, process_t * state)
    if (!strncasecmp (name, "FILE:", 5))
       name += 5;
    if (set)
-      len = strlen (v = expand (tempvar, sizeof (tempvar), set));
+      len = strlen (v = expandx (&tempvar, x, set));
    else
-      v = getvar (expand (tempvar, sizeof (tempvar), name), &len, NULL, NULL);
+      v = getvar (expandx (&tempvar, x, name), &len, NULL, NULL);
    if (len)
    {
       if (!size && maxinputsize)
@@ -3452,25 +6002,25 @@ doinput (xmltoken * x, process_t * state)
    {
       if (type && !strcasecmp (type, "radio"))
       {
-         char temp[MAXTEMP];
+         TEMP (temp);
          checked = size = maxlength = XMLATTREMOVE;
-         if (value && !strcmp (v, expand (temp, sizeof (temp), value)))
+         if (value && !strcmp (v, expandx (&temp, x, value)))
             checked = "checked";
       } else if (type && !strcasecmp (type, "checkbox"))
       {
-         char temp[MAXTEMP];
+         TEMP (temp);
          checkval = value;
          if (!checkval)
             checkval = "on";
          checked = size = maxlength = XMLATTREMOVE;
-         if (*v && matchvalue (v, expand (temp, sizeof (temp), checkval)))
+         if (*v && matchvalue (v, expandx (&temp, x, checkval)))
             checked = "checked";
       } else if (!type || strcasecmp (type, "file"))
          checkval = value = v;
    } else if (checked)
    {
-      char temp[1000];
-      if (!expand (temp, sizeof (temp), checked))
+      TEMP (temp);
+      if (!expandx (&temp, x, checked))
          checked = XMLATTREMOVE;
    }
    if (trim && value)
@@ -3501,7 +6051,7 @@ doinput (xmltoken * x, process_t * state)
          checkval = 0;
       if (checkval)
       {
-         char *class = getatt (x, "class");
+         char *class = getatt (x, ATT_CLASS);
          if (class)
             xmlwrite (of, 0, "span", "class", class, (char *) 0);
          fprintf (of, "%s", checkval);
@@ -3534,7 +6084,7 @@ doform (xmltoken * x, process_t * state)
       warning (x, "Unclosed FORM tag");
       return x->next;
    }
-   char *class = getatt (x, "class");
+   char *class = getatt (x, ATT_CLASS);
    if (class)
       xmlwrite (of, 0, "div", "class", class, (char *) 0);
    processxml (x->next, x->end, state);
@@ -3546,7 +6096,7 @@ doform (xmltoken * x, process_t * state)
 xmltoken *
 doscript (xmltoken * x, process_t * state)
 {
-   char *object = getatt (x, "object");
+   char *object = getatt (x, ATT_OBJECT);
    tagwrite (of, x, "var", XMLATTREMOVE, "object", XMLATTREMOVE, (void *) 0);
    int a;
    if (object)
@@ -3578,17 +6128,7 @@ doscript (xmltoken * x, process_t * state)
                         fprintf (of, "%s:'", field[l][f].name);
                      else
                         fprintf (of, "var %s='", field[l][f].name);
-                     char *p = row[l][f];
-                     while (*p)
-                     {
-                        if (*p == '\n')
-                           fprintf (of, "\\n");
-                        else if (*p == '\\' || *p == '\'')
-                           fprintf (of, "\\%c", *p);
-                        else
-                           fputc (*p, of);
-                        p++;
-                     }
+                     escputs (of, ESC_JS, row[l][f]);
                      fprintf (of, "'");
                      if (!object)
                         fprintf (of, ";");
@@ -3675,18 +6215,7 @@ doscript (xmltoken * x, process_t * state)
             else
             {
                fprintf (of, "'");
-               char *p = v,
-                  *e = v + l;
-               while (p < e)
-               {
-                  if (*p == '\n')
-                     fprintf (of, "\\n");
-                  else if (*p == '\\' || *p == '\'')
-                     fprintf (of, "\\%c", *p);
-                  else
-                     fputc (*p, of);
-                  p++;
-               }
+               escwrite (of, ESC_JS, v, l);
                fprintf (of, "'");
             }
             if (!object)
@@ -3703,23 +6232,23 @@ doscript (xmltoken * x, process_t * state)
 xmltoken *
 doimg (xmltoken * x, process_t * state)
 {
-   char tempatt[MAXTEMP];
-   char tempalt[MAXTEMP];
-   char *alt = getatt (x, "alt");
+   TEMP (tempatt);
+   TEMP (tempalt);
+   char *alt = getatt (x, ATT_ALT);
    if (!alt)
-      alt = getatt (x, "title");
+      alt = getatt (x, ATT_TITLE);
    if (!alt)
-      alt = getatt (x, "src");
+      alt = getatt (x, ATT_SRC);
    if (!alt)
       alt = "";                 // Force an alt tag of some sort
-   alt = expand (tempalt, sizeof (tempalt), alt);
-   char *file = getatt (x, "base64");
+   alt = expandx (&tempalt, x, alt);
+   char *file = getatt (x, ATT_BASE64);
    if (!file)
    {                            // Not interested
       tagwrite (of, x, "base64", XMLATTREMOVE, "alt", alt, (void *) 0);
       return x->next;
    }
-   char *ta = expand (tempatt, sizeof (tempatt), file);
+   char *ta = expandx (&tempatt, x, file);
    int f = open (ta, O_RDONLY);
    if (f < 0)
    {
@@ -3758,7 +6287,7 @@ doimg (xmltoken * x, process_t * state)
    int a;
    for (a = 0; a < x->attrs; a++)
       if (strcasecmp (x->attr[a].attribute, "base64") && strcasecmp (x->attr[a].attribute, "src"))
-         expandwriteattr (of, x->attr[a].attribute, x->attr[a].value);
+         expandwriteattr (of, &x->attr[a]);
    fprintf (of, " src=\"data:%s;base64,", type);
    char buf[1024];
    int v = 0,
@@ -3812,8 +6341,8 @@ doimg (xmltoken * x, process_t * state)
 xmltoken *
 doselect (xmltoken * x, process_t * state)
 {                               // do select function
-   char *name = getatt (x, "NAME");
-   char *set = getatt (x, "set");
+   char *name = getatt (x, ATT_NAME);
+   char *set = getatt (x, ATT_SET);
    if (!noform)
       tagwrite (of, x, (void *) 0);
    if (!x->end)
@@ -3835,16 +6364,16 @@ doselect (xmltoken * x, process_t * state)
       };
       char *v = 0;
       {
-         char temp[100];
+         TEMP (temp);
          if (set)
-            v = expand (temp, sizeof (temp), set);
+            v = expandx (&temp, x, set);
          else
-            v = getvar (expand (temp, sizeof (temp), name), NULL, &l, &f);
+            v = getvar (expandx (&temp, x, name), NULL, &l, &f);
+         if (v)
+            v = strdup (v);
       }
-      if (v)
-         v = strdup (v);
       state.selectvalue = v;
-      if (xmlfindattr (x, "MULTIPLE"))
+      if (findatt (x, ATT_MULTIPLE))
          state.selectmultiple = 1;
       if (x->next == x->end)
       {                         // Self closed select, special handling
@@ -3852,61 +6381,68 @@ doselect (xmltoken * x, process_t * state)
          {                      // Options from ENUM
             if (!(field[l][f].flags & NOT_NULL_FLAG))
                fprintf (of, "<option value='null'%s>---</option>", !v ? " selected" : "");
-            SQL_RES *res = sql_safe_query_store_f (&sql, "DESCRIBE `%#S`.`%#S` `%#S`", field[l][f].db, field[l][f].org_table,
-                                                   field[l][f].org_name);
-            if (sql_fetch_row (res))
+            char *p = NULL;
+            schema_t *c = schemafind (field[l][f].db, field[l][f].org_table, field[l][f].org_name);
+            if (c && c->type)
+               p = strdupa (c->type);
+            else
             {
-               char *p = strdupa (sql_colz (res, "Type"));
-               if (!strncmp (p, "enum(", 5))
-               {                // Very messy parsing of enum declaration, FFS
-                  p += 5;
-                  while (*p == '\'')
+               SQL_RES *res = sql_safe_query_store_f (sqlconn (), "DESCRIBE `%#S`.`%#S` `%#S`", field[l][f].db, field[l][f].org_table,
+                                                      field[l][f].org_name);
+               if (sql_fetch_row (res))
+                  p = strdupa (sql_colz (res, "Type"));
+               sql_free_result (res);
+               if (c && p && !(c->type = strdup (p)))
+                  errx (1, "malloc at line %d", __LINE__);
+            }
+            if (p && !strncmp (p, "enum(", 5))
+            {                   // Very messy parsing of enum declaration, FFS
+               p += 5;
+               while (*p == '\'')
+               {
+                  p++;
+                  char *q = p,
+                     *o = p,
+                     *t = p;
+                  while (*q)
                   {
-                     p++;
-                     char *q = p,
-                        *o = p,
-                        *t = p;
-                     while (*q)
+                     if (*q == '\'')
                      {
-                        if (*q == '\'')
-                        {
-                           if (q[1] != '\'')
-                              break;
-                           q++;
-                        } else if (*q == '\\' && q[1])
-                        {
-                           q++;
-                           if (*q == 'n')
-                              *o++ = '\n';
-                           else if (*q == 'b')
-                              *o++ = '\b';
-                           else if (*q == 'r')
-                              *o++ = '\r';
-                           else if (*q == 't')
-                              *o++ = '\t';
-                           else if (*q == 'Z')
-                              *o++ = 26;
-                           else
-                              *o++ = *q;
-                           q++;
-                           continue;
-                        }
-                        *o++ = *q++;
+                        if (q[1] != '\'')
+                           break;
+                        q++;
+                     } else if (*q == '\\' && q[1])
+                     {
+                        q++;
+                        if (*q == 'n')
+                           *o++ = '\n';
+                        else if (*q == 'b')
+                           *o++ = '\b';
+                        else if (*q == 'r')
+                           *o++ = '\r';
+                        else if (*q == 't')
+                           *o++ = '\t';
+                        else if (*q == 'Z')
+                           *o++ = 26;
+                        else
+                           *o++ = *q;
+                        q++;
+                        continue;
                      }
-                     if (*q != '\'')
-                        break;
-                     *o = 0;
-                     *q++ = 0;
-                     p = q;
-                     if (*p == ',')
-                        p++;
-                     fprintf (of, "<option%s>", v && !strcmp (v, t) ? " selected" : "");
-                     xputs (t, of, FLAG_XML);
-                     fprintf (of, "</option>");
+                     *o++ = *q++;
                   }
+                  if (*q != '\'')
+                     break;
+                  *o = 0;
+                  *q++ = 0;
+                  p = q;
+                  if (*p == ',')
+                     p++;
+                  fprintf (of, "<option%s>", v && !strcmp (v, t) ? " selected" : "");
+                  xputs (t, of, FLAG_XML);
+                  fprintf (of, "</option>");
                }
             }
-            sql_free_result (res);
          }
          fprintf (of, "</select>");
       }
@@ -3923,8 +6459,8 @@ dooption (xmltoken * x, process_t * state)
 {
    if (state && state->selectvalue)
    {
-      char temp[MAXTEMP];
-      char *value = expand (temp, sizeof (temp), getatt (x, "value"));
+      TEMP (temp);
+      char *value = expand (&temp, getatt (x, ATT_VALUE));
       char *r = 0,
          t = 0;
       char *selected = XMLATTREMOVE;
@@ -3969,9 +6505,9 @@ dooption (xmltoken * x, process_t * state)
 xmltoken *
 dotextarea (xmltoken * x, process_t * state)
 {                               // do textarea function
-   char *name = getatt (x, "name");
-   char *file = getatt (x, "file");
-   char tempvar[100];
+   char *name = getatt (x, ATT_NAME);
+   char *file = getatt (x, ATT_FILE);
+   TEMP (tempvar);
    char *v;
    if (!x->end)
    {
@@ -3991,51 +6527,33 @@ dotextarea (xmltoken * x, process_t * state)
    x->type &= ~XML_END;
    if (!noform)
       tagwrite (of, x, "file", XMLATTREMOVE, (void *) 0);
-   char *class = getatt (x, "class");
+   x->type = type;              // token may be cached and used again
+   char *class = getatt (x, ATT_CLASS);
    if (!strncasecmp (name, "FILE:", 5))
       name += 5;
-   v = getvar (expand (tempvar, sizeof (tempvar), name), NULL, NULL, NULL);
+   v = getvar (expandx (&tempvar, x, name), NULL, NULL, NULL);
    if (v)
    {
       if (noform && class)
          xmlwrite (of, 0, "span", "class", class, (char *) 0);
-      while (*v)
-      {
-         if (*v == '<')
-            fprintf (of, "&lt;");
-         else if (*v == '>')
-            fprintf (of, "&gt;");
-         else if (*v == '&')
-            fprintf (of, "&amp;");
-         else
-            fputc (*v, of);
-         v++;
-      }
+      escputs (of, ESC_TEXT, v);
       if (noform && class)
          fprintf (of, "</span>");
       x = x->end;
       type |= XML_END;
    } else if (file && !safe)
    {
-      char temp[MAXTEMP];
-      file = expand (temp, sizeof (temp), file);
+      TEMP (temp);
+      file = expandx (&temp, x, file);
       FILE *f = fopen (file, "r");
       if (f)
       {
-         int c;
+         char buf[8192];
+         size_t l;
          if (noform && class)
             xmlwrite (of, 0, "span", "class", class, (char *) 0);
-         while ((c = fgetc (f)) >= 0)
-         {
-            if (c == '<')
-               fprintf (of, "&lt;");
-            else if (c == '>')
-               fprintf (of, "&gt;");
-            else if (c == '&')
-               fprintf (of, "&amp;");
-            else
-               fputc (c, of);
-         }
+         while ((l = fread (buf, 1, sizeof (buf), f)) > 0)
+            escwrite (of, ESC_TEXT, buf, l);
          fclose (f);
          if (noform && class)
             fprintf (of, "</span>");
@@ -4052,47 +6570,46 @@ dotextarea (xmltoken * x, process_t * state)
 
 xmltoken *
 doinclude (xmltoken * x, process_t * state, char *value)
-{                               // src overrides the src check
-   xmlattr *a = xmlfindattr (x, "SRC");
-   if (value || (a && a->value))
+{                               // value is set for EXEC output in a temporary file
+   xmlattr *a = findatt (x, ATT_SRC);
+   if (value)
+   {                            // temporary file, not cached
+      char *buf = NULL;
+      size_t maplen = 0;
+      xmlarena *arena = xmlarenanew (0);
+      xmltoken *i = loadfile (value, &buf, &maplen, arena);
+      if (i)
+         processxml (i, NULL, state);
+      arenafree (arena);
+      if (maplen)
+         munmap (buf, maplen);
+      else
+         free (buf);
+   } else if (a && a->value)
    {
-      char temp[MAXTEMP];
-      if (!value)
-      {
-         value = expand (temp, sizeof (temp), a->value);
-         if (strcmp (a->value, value))
-            info (x, "Include %s [%s]", a->value, value);
-         else
-            info (x, "Include %s", a->value);
-      }
-      xmltoken *i = loadfile (value);
+      TEMP (temp);
+      value = expandattr (&temp, a);
+      if (strcmp (a->value, value))
+         info (x, "Include %s [%s]", a->value, value);
+      else
+         info (x, "Include %s", a->value);
+      xmltoken *i = loadtemplate (value);       // cached, so not re-parsed every time
       if (i)
-      {                         // included
-         xmltoken *l = x->next;
-         x->next = i;
-         while (i && i->next)
-            i = (i->end && i->end != i ? i->end : i->next);
-         i->next = l;
-      }
-   } else if ((a = xmlfindattr (x, "VAR")) && a->value)
+         processxml (i, NULL, state);
+   } else if ((a = findatt (x, ATT_VAR)) && a->value)
    {                            // Include a variable directly
       value = getvar (a->value, NULL, NULL, NULL);
       if (value)
       {
-         value = strdup (value);
-         // Not freed as used as part of the parsed strings
-         xmltoken *i = xmlparse ((char *) value, a->value);
+         xmlarena *arena = xmlarenanew (0);
+         value = xmlarenastrdup (arena, value);
+         xmltoken *i = xmlparse ((char *) value, a->value, arena);
+         tagcode (i, arena);
          if (i)
-         {                      // included
-            xmltoken *l = x->next;
-            x->next = i;
-            while (i && i->next)
-               i = (i->end && i->end != i ? i->end : i->next);
-            i->next = l;
-         }
+            processxml (i, NULL, state);
+         arenafree (arena);
       }
    }
-   x->attrs = 0;                // Don't re-run
    return x->next;
 }
 
@@ -4133,14 +6650,14 @@ doexec (xmltoken * x, process_t * state)
                v = a->value;
             if (v)
             {
-               char temp[MAXTEMP];
-               char *e = expand (temp, sizeof (temp), v);
+               TEMP (temp);
+               char *e = expandx (&temp, x, v);
                if (e)
                {
                   fprintf (out, "%s", e);
                   if (v != a->value && a->value)
                   {
-                     char *v = expand (temp, sizeof (temp), a->value);
+                     char *v = expandattr (&temp, a);
                      if (v)
                         fprintf (out, "=%s", v);
                   }
@@ -4156,8 +6673,9 @@ doexec (xmltoken * x, process_t * state)
       if (include)
          dup2 (tempf, fileno (stdout));
       else
-         dup2 (fileno (of), fileno (stdout));
+         dup2 (outfileno (of), fileno (stdout));
       close (fileno (stdin));
+      varexport ();
       execvp (args[0], args);
       exit (0);
    }
@@ -4171,110 +6689,210 @@ doexec (xmltoken * x, process_t * state)
 }
 
 xmltoken *
-processxml (xmltoken * x, xmltoken * e, process_t * state)
+doincludetag (xmltoken * x, process_t * state)
 {
-   xmltoken *last = NULL;
-   while (x && x != e && !feof (of))
+   return doinclude (x, state, NULL);
+}
+
+xmltoken *
+doexectag (xmltoken * x, process_t * state)
+{
+   if (!allowexec)
+      errx (1, "Use of <exec.../> without --exec");
+   return doexec (x, state);
+}
+
+// CACHE tag, output of the content saved in --cache-dir and used again until it expires
+#define	FRAGMENTMAGIC	"XMLSQLF1"
+typedef struct
+{
+   char magic[8];
+   uint64_t expires;            // time_t
+   uint64_t len;                // output
+   uint32_t keylen;             // key, before the output, as file name is a hash
+} fragmenthead_t;
+
+xmltoken *
+docache (xmltoken * x, process_t * state)
+{                               // do cache function
+   if (!x->end)
    {
-      if (debug)
-         fflush (of);
-      if ((x->type & XML_END) && x == last)
+      warning (x, "Unclosed CACHE tag");
+      return x->next;
+   }
+   TEMP (temp);
+   TEMP (tempttl);
+   char *key = expandattr (&temp, findatt (x, ATT_KEY));
+   char *ttl = expandattr (&tempttl, findatt (x, ATT_TTL));
+   int t = atoi (ttl ? : "");
+   if (!cachedir || !key || t <= 0)
+   {                            // not cached
+      processxml (x->next, x->end, state);
+      return x->end->next;
+   }
+   size_t keylen = strlen (key);
+   char *path = cachepath (key, keylen, "xmlsqlf");
+   int f = open (path, O_RDONLY);
+   if (f >= 0)
+   {
+      struct stat s;
+      fragmenthead_t *h = MAP_FAILED;
+      if (!fstat (f, &s) && s.st_size >= sizeof (*h))
+         h = mmap (NULL, s.st_size, PROT_READ, MAP_SHARED, f, 0);
+      close (f);
+      if (h != MAP_FAILED)
       {
-         last = x = x->next;
-         continue;
+         char *k = (void *) (h + 1);
+         if (!memcmp (h->magic, FRAGMENTMAGIC, sizeof (h->magic)) && h->expires > time (0) && h->keylen == keylen
+             && sizeof (*h) + keylen + h->len <= s.st_size && !memcmp (k, key, keylen))
+         {                      // hit
+            info (x, "CACHE %s", key);
+            fwrite (k + keylen, 1, h->len, of);
+            munmap (h, s.st_size);
+            free (path);
+            return x->end->next;
+         }
+         munmap (h, s.st_size);
       }
-      last = x;
-      if (x->type & XML_START)
+   }
+   // Miss, capture output in a real file, so EXEC output is captured too
+   FILE *o = of;
+   if (!(of = tmpfile ()))
+   {
+      warn ("Cache [%s]", path);
+      of = o;
+      free (path);
+      processxml (x->next, x->end, state);
+      return x->end->next;
+   }
+   processxml (x->next, x->end, state);
+   long l = (fflush (of) ? -1 : ftell (of));
+   size_t len = (l > 0 ? l : 0);
+   char *data = malloc (len + 1);
+   if (!data)
+      errx (1, "malloc at line %d", __LINE__);
+   rewind (of);
+   int bad = (l < 0 || fread (data, 1, len, of) != len);
+   fclose (of);
+   of = o;
+   if (bad)
+   {
+      warnx ("Cache [%s] output could not be read back", key);
+      free (data);
+      free (path);
+      return x->end->next;
+   }
+   fwrite (data, 1, len, of);
+   fragmenthead_t h = {.expires = time (0) + t,.len = len,.keylen = keylen };
+   memcpy (h.magic, FRAGMENTMAGIC, sizeof (h.magic));
+   char *tempname = NULL;
+   if (asprintf (&tempname, "%s/.xmlsqlfXXXXXX", cachedir) < 0)
+      errx (1, "malloc at line %d", __LINE__);
+   f = mkstemp (tempname);
+   if (f < 0)
+      warn ("Cache [%s]", tempname);
+   else
+   {                            // write to temporary file and rename, so readers never see a partial file
+      FILE *w = fdopen (f, "w");
+      if (!w)
       {
-         if (!strcasecmp (x->content, "OUTPUT") || !strcasecmp (x->content, "xmlsql:OUTPUT"))
-         {
-            x = dooutput (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "IF") || !strcasecmp (x->content, "xmlsql:IF") || !strcasecmp (x->content, "WHILE")
-             || !strcasecmp (x->content, "xmlsql:WHILE"))
-         {
-            x = doif (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "LATER") || !strcasecmp (x->content, "xmlsql:LATER"))
-         {
-            x = dolater (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "FOR") || !strcasecmp (x->content, "xmlsql:FOR"))
-         {
-            x = dofor (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "DIR") || !strcasecmp (x->content, "xmlsql:DIR"))
-         {
-            x = dodir (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "SET") || !strcasecmp (x->content, "xmlsql:SET"))
-         {
-            x = doset (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "EVAL") || !strcasecmp (x->content, "xmlsql:EVAL"))
-         {
-            x = doeval (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "SQL") || !strcasecmp (x->content, "xmlsql:SQL"))
-         {
-            x = dosql (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "INCLUDE") || !strcasecmp (x->content, "xmlsql:INCLUDE"))
-         {
-            x = doinclude (x, state, NULL);
-            continue;
-         }
-         if ((!strcasecmp (x->content, "EXEC") || !strcasecmp (x->content, "xmlsql:EXEC")))
-         {
-            if (!allowexec)
-               errx (1, "Use of <exec.../> without --exec");
-            x = doexec (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "INPUT"))
-         {
-            x = doinput (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "SELECT"))
-         {
-            x = doselect (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "OPTION"))
-         {
-            x = dooption (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "TEXTAREA"))
-         {
-            x = dotextarea (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "FORM"))
-         {
-            x = doform (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "SCRIPT"))
-         {
-            x = doscript (x, state);
-            continue;
-         }
-         if (!strcasecmp (x->content, "IMG"))
+         warn ("Cache [%s]", tempname);
+         close (f);
+         unlink (tempname);
+      } else
+      {
+         fchmod (f, 0644);
+         int e = (fwrite (&h, sizeof (h), 1, w) != 1 || fwrite (key, 1, keylen, w) != keylen || fwrite (data, 1, len, w) != len);
+         if (fclose (w) || e || rename (tempname, path))
          {
-            x = doimg (x, state);
-            continue;
+            warn ("Cache [%s]", path);
+            unlink (tempname);
          }
-      } else if ((x->type & XML_END) && security && !strcasecmp (x->content, "FORM"))
+      }
+   }
+   free (tempname);
+   free (data);
+   free (path);
+   return x->end->next;
+}
+
+// Tag names, in tag code order, and if allowed with xmlsql: name space prefix
+static const struct
+{
+   const char *name;
+   char ns;
+} tagname[TAG_MAX] = {
+   [TAG_OUTPUT] = {"OUTPUT", 1},
+   [TAG_IF] = {"IF", 1},
+   [TAG_WHILE] = {"WHILE", 1},
+   [TAG_LATER] = {"LATER", 1},
+   [TAG_FOR] = {"FOR", 1},
+   [TAG_DIR] = {"DIR", 1},
+   [TAG_SET] = {"SET", 1},
+   [TAG_EVAL] = {"EVAL", 1},
+   [TAG_SQL] = {"SQL", 1},
+   [TAG_INCLUDE] = {"INCLUDE", 1},
+   [TAG_EXEC] = {"EXEC", 1},
+   [TAG_INPUT] = {"INPUT", 0},
+   [TAG_SELECT] = {"SELECT", 0},
+   [TAG_OPTION] = {"OPTION", 0},
+   [TAG_TEXTAREA] = {"TEXTAREA", 0},
+   [TAG_FORM] = {"FORM", 0},
+   [TAG_SCRIPT] = {"SCRIPT", 0},
+   [TAG_IMG] = {"IMG", 0},
+   [TAG_CACHE] = {"CACHE", 1},
+};
+
+// Tag processing, by tag code, NULL to just output the tag
+static xmltoken *(*const tagdo[TAG_MAX]) (xmltoken *, process_t *) =
+{
+[TAG_OUTPUT] = dooutput,[TAG_IF] = doif,[TAG_WHILE] = doif,[TAG_LATER] = dolater,[TAG_FOR] = dofor,[TAG_DIR] =
+      dodir,[TAG_SET] = doset,[TAG_EVAL] = doeval,[TAG_SQL] = dosql,[TAG_INCLUDE] = doincludetag,[TAG_EXEC] =
+      doexectag,[TAG_INPUT] = doinput,[TAG_SELECT] = doselect,[TAG_OPTION] = dooption,[TAG_TEXTAREA] =
+      dotextarea,[TAG_FORM] = doform,[TAG_SCRIPT] = doscript,[TAG_IMG] = doimg,[TAG_CACHE] = docache,};
+
+void
+tagcode (xmltoken * x, xmlarena * arena)
+{                               // set tag codes and attribute indexes in a parsed token list, so processing does not compare names
+   for (; x; x = x->next)
+   {
+      attindex (x, arena);
+      x->tag = TAG_NONE;
+      if (!(x->type & (XML_START | XML_END)))
+         continue;
+      const char *c = x->content;
+      char ns = 0;
+      if (!strncasecmp (c, "xmlsql:", 7))
+      {
+         c += 7;
+         ns = 1;
+      }
+      int t;
+      for (t = 1; t < TAG_MAX && (strcasecmp (c, tagname[t].name) || (ns && !tagname[t].ns)); t++);
+      if (t < TAG_MAX)
+         x->tag = t;
+   }
+}
+
+xmltoken *
+processxml (xmltoken * x, xmltoken * e, process_t * state)
+{
+   xmltoken *last = NULL;
+   while (x && x != e && !feof (of) && !ferror (of))
+   {
+      if (debug)
+         fflush (of);
+      if ((x->type & XML_END) && x == last)
+      {
+         last = x = x->next;
+         continue;
+      }
+      last = x;
+      if ((x->type & XML_START) && tagdo[x->tag])
+      {
+         x = tagdo[x->tag] (x, state);
+         continue;
+      } else if ((x->type & XML_END) && security && x->tag == TAG_FORM)
          fprintf (of, "<input type='hidden' name='" QUOTE (SECURITYTAG) "' value='%s'>", security);     // Security as last input item in any form
       if ((comment || !(x->type & XML_COMMENT)) && (!noform || !state || !state->selectvalue || state->selectedoption))
          tagwrite (of, x, (void *) 0);
@@ -4285,8 +6903,9 @@ processxml (xmltoken * x, xmltoken * e, process_t * state)
 }
 
 xmltoken *
-loadfile (char *fn)
-{
+loadfile (char *fn, char **bufp, size_t *maplenp, xmlarena * arena)
+{                               // load and parse a file, the tokens reference the buffer, returned in bufp if not NULL, and are allocated from arena
+   // a regular file is mapped privately, as the parser writes in to it, and maplenp set to its length to unmap, else 0 if malloced
    if (!fn || !*fn)
    {
       warn ("Empty file included in input list, ignored");
@@ -4302,7 +6921,7 @@ loadfile (char *fn)
    if (!fn || !strcmp (fn, "-"))
    {
       f = fileno (stdin);
-      fntag = getenv ("SCRIPT_NAME") ? : fntag;
+      fntag = varget ("SCRIPT_NAME") ? : fntag;
    } else
    {
       f = open (fn, O_RDONLY);
@@ -4324,44 +6943,865 @@ loadfile (char *fn)
    }
    if (debug && len)
       fprintf (stderr, "Loading %s: %lu bytes\n", fntag, len);
-   if (len)
-   {
-      buf = malloc ((all = len + 2));
+   size_t maplen = 0;
+   if (len && maplenp)
+   {                            // zeroed anonymous pages with the file mapped over the start, so always a NUL after the end
+      maplen = len + 1;
+      buf = mmap (NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buf == MAP_FAILED || mmap (buf, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, f, 0) == MAP_FAILED)
+      {
+         if (buf != MAP_FAILED)
+            munmap (buf, maplen);
+         buf = NULL;
+         maplen = 0;
+      } else
+      {
+         madvise (buf, len, MADV_SEQUENTIAL);
+         pos = len;
+      }
+   }
+   if (!maplen)
+   {                            // read, e.g. a pipe, buffer doubling as needed
+      all = (len ? len + 2 : 65536);
+      buf = malloc (all);
       if (!buf)
          errx (1, "Malloc %lu", all);
-   }
-   while (1)
-   {
-      long l;
-      if (pos + 1 >= all)
+      while (1)
       {
-         all += 10000;
-         buf = realloc (buf, all);
-         if (!buf)
-            errx (1, "Malloc %lu", all);
+         long l;
+         if (pos + 1 >= all)
+         {
+            all *= 2;
+            buf = realloc (buf, all);
+            if (!buf)
+               errx (1, "Malloc %lu", all);
+         }
+         l = read (f, buf + pos, all - pos - 1);
+         if (l < 0)
+            err (1, "Reading file [%s]", fntag);
+         if (l == 0)
+            break;
+         pos += l;
       }
-      l = read (f, buf + pos, all - pos - 1);
-      if (l < 0)
-         err (1, "Reading file [%s]", fntag);
-      if (l == 0)
-         break;
-      pos += l;
+      buf = realloc (buf, pos + 1);
+      if (!buf)
+         errx (1, "malloc at line %d", __LINE__);
+      buf[pos] = 0;
    }
-   buf = realloc (buf, pos + 1);
-   if (!buf)
-      errx (1, "malloc at line %d", __LINE__);
-   buf[pos] = 0;
+   if (maplenp)
+      *maplenp = maplen;
    if (debug && !len)
       fprintf (stderr, "Loaded %s: %lu bytes\n", fntag, pos);
    if (f != fileno (stdin))
       close (f);
-   n = xmlparse ((char *) buf, fntag);
+   n = xmlparse ((char *) buf, fntag, arena);
    if (!n)
       warnx ("Cannot parse %s\n", fn);
-   xmlendmatch (n, "IF\tSQL\tWHILE\tFOR\tTEXTAREA\tSELECT\tLATER\tXMLSQL\tFORM\tDIR");
+   xmlendmatch (n, ENDMATCH);
+   tagcode (n, arena);
+   if (bufp)
+      *bufp = (char *) buf;
    return n;
 }
 
+// Parsed templates, kept so includes in loops, and requests in SCGI mode, do not load and parse again
+typedef struct template_s
+{
+   struct template_s *next;
+   char *filename;
+   dev_t dev;
+   ino_t ino;
+   off_t size;
+   struct timespec mtime;
+   char *buf;                   // source, the tokens point in to this
+   xmltoken *tokens;
+   size_t maplen;               // buf is mapped, compiled template file or source
+   xmlarena *arena;             // tokens, attributes, and strings
+} template_t;
+template_t *templates = NULL;
+template_t *templatesold = NULL;        // replaced, but may still be in use until the end of the request
+
+// Compiled template file, in --template-cache directory, named from the hash of the full path
+// The parsed source image (with its NUL terminated strings) is stored along with tokens and attributes using offsets,
+// so can be mapped and used without parsing
+#define	TEMPLATEMAGIC	"XMLSQLT3"
+#define	TEMPLATENONE	0xFFFFFFFF      // NULL pointer
+typedef struct
+{
+   char magic[8];
+   uint64_t dev,
+     ino,
+     size,
+     mtime,
+     mtimensec;                 // source file
+   uint32_t tokens,
+     attrs,
+     buflen;
+} templatehead_t;
+typedef struct
+{
+   uint32_t next,
+     start,
+     end;                       // token index, or TEMPLATENONE
+   uint32_t content;            // offset in source image
+   uint32_t attr;               // first attribute index
+   uint32_t attrs;
+   uint32_t line,
+     level;
+   uint8_t type,
+     utf8,
+     tag;
+} templatetoken_t;
+typedef struct
+{
+   uint32_t attribute,
+     value;                     // offset in source image
+} templateattr_t;
+
+static char *
+templatepath (const char *fn)
+{                               // malloced path of compiled template file
+   char *real = realpath (fn, NULL);
+   if (!real)
+      return NULL;
+   unsigned char hash[SHA_DIGEST_LENGTH];
+   SHA1 ((unsigned char *) real, strlen (real), hash);
+   free (real);
+   char *path = NULL;
+   if (asprintf (&path, "%s/%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x.xmlsqlt", templatecache,
+                 hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7], hash[8], hash[9], hash[10], hash[11],
+                 hash[12], hash[13], hash[14], hash[15], hash[16], hash[17], hash[18], hash[19]) < 0)
+      errx (1, "malloc at line %d", __LINE__);
+   return path;
+}
+
+int
+templatemap (template_t * t)
+{                               // load compiled template, 0 if OK
+   char *path = templatepath (t->filename);
+   if (!path)
+      return -1;
+   int f = open (path, O_RDONLY);
+   free (path);
+   if (f < 0)
+      return -1;
+   struct stat s;
+   templatehead_t *h = MAP_FAILED;
+   if (!fstat (f, &s) && s.st_size >= sizeof (*h))
+      h = mmap (NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, f, 0);  // private, as strings may be changed in place
+   close (f);
+   if (h == MAP_FAILED)
+      return -1;
+   templatetoken_t *tt = (void *) (h + 1);
+   templateattr_t *ta = (void *) (tt + h->tokens);
+   char *buf = (void *) (ta + h->attrs);
+   if (memcmp (h->magic, TEMPLATEMAGIC, sizeof (h->magic)) || h->dev != t->dev || h->ino != t->ino || h->size != t->size
+       || h->mtime != t->mtime.tv_sec || h->mtimensec != t->mtime.tv_nsec || !h->tokens || h->buflen != h->size + 1
+       || sizeof (*h) + (uint64_t) h->tokens * sizeof (*tt) + (uint64_t) h->attrs * sizeof (*ta) + h->buflen != s.st_size
+       || buf[h->buflen - 1])
+   {                            // stale or not valid, the source image must end with a NUL so no string runs off the end
+      munmap (h, s.st_size);
+      return -1;
+   }
+   size_t len = sizeof (xmltoken) * h->tokens + sizeof (xmlattr) * h->attrs;
+   t->arena = xmlarenanew (len);
+   xmltoken *x = xmlarenaalloc (t->arena, len);
+   xmlattr *a = (void *) (x + h->tokens);
+   char *fntag = strrchr (t->filename, '/');
+   fntag = (fntag ? fntag + 1 : t->filename);
+   uint32_t n;
+   char *str (uint32_t o)
+   {
+      if (o == TEMPLATENONE || o >= h->buflen)
+         return NULL;
+      return buf + o;
+   }
+   xmltoken *tok (uint32_t i)
+   {
+      if (i >= h->tokens)
+         return NULL;
+      return x + i;
+   }
+   for (n = 0; n < h->attrs; n++)
+   {
+      a[n].attribute = str (ta[n].attribute);
+      a[n].value = str (ta[n].value);
+   }
+   for (n = 0; n < h->tokens; n++)
+   {
+      x[n].next = tok (tt[n].next);
+      x[n].start = tok (tt[n].start);
+      x[n].end = tok (tt[n].end);
+      x[n].content = str (tt[n].content);
+      x[n].type = tt[n].type;
+      x[n].utf8 = tt[n].utf8;
+      x[n].tag = (tt[n].tag < TAG_MAX ? tt[n].tag : TAG_NONE);
+      x[n].filename = fntag;
+      x[n].line = tt[n].line;
+      x[n].level = tt[n].level;
+      if (tt[n].attrs && tt[n].attr < h->attrs && tt[n].attrs <= h->attrs - tt[n].attr)
+      {
+         x[n].attrs = tt[n].attrs;
+         x[n].attr = a + tt[n].attr;
+      }
+      attindex (x + n, t->arena);
+   }
+   t->buf = (void *) h;
+   t->maplen = s.st_size;
+   t->tokens = x;
+   return 0;
+}
+
+void
+templatesave (template_t * t)
+{                               // write compiled template, if possible
+   xmltoken *x;
+   uint32_t tokens = 0,
+      attrs = 0,
+      n;
+   size_t buflen = t->size + 1;
+   for (x = t->tokens; x; x = x->next)
+   {
+      tokens++;
+      attrs += x->attrs;
+      if (x->styles)
+         return;                // not expected
+   }
+   // Index of each token, by pointer
+   uint32_t hashsize = 1;
+   while (hashsize < tokens * 2)
+      hashsize <<= 1;
+   xmltoken **hash = calloc (hashsize, sizeof (*hash));
+   uint32_t *index = malloc (hashsize * sizeof (*index));
+   templatehead_t h = {.tokens = tokens,.attrs = attrs,.buflen = buflen,.dev = t->dev,.ino = t->ino,.size = t->size,.mtime =
+         t->mtime.tv_sec,.mtimensec = t->mtime.tv_nsec
+   };
+   templatetoken_t *tt = calloc (tokens, sizeof (*tt));
+   templateattr_t *ta = calloc (attrs ? : 1, sizeof (*ta));
+   if (!hash || !index || !tt || !ta)
+      errx (1, "malloc at line %d", __LINE__);
+   memcpy (h.magic, TEMPLATEMAGIC, sizeof (h.magic));
+   uint32_t slot (xmltoken * x)
+   {
+      uint32_t s = ((uintptr_t) x / sizeof (*x)) & (hashsize - 1);
+      while (hash[s] && hash[s] != x)
+         s = (s + 1) & (hashsize - 1);
+      return s;
+   }
+   for (n = 0, x = t->tokens; x; x = x->next, n++)
+   {
+      uint32_t s = slot (x);
+      hash[s] = x;
+      index[s] = n;
+   }
+   uint32_t tok (xmltoken * x)
+   {
+      if (!x)
+         return TEMPLATENONE;
+      uint32_t s = slot (x);
+      if (!hash[s])
+         return TEMPLATENONE;
+      return index[s];
+   }
+   int bad = 0;
+   uint32_t str (char *p)
+   {
+      if (!p)
+         return TEMPLATENONE;
+      if (p < t->buf || p >= t->buf + buflen)
+      {                         // e.g. $variable expanded by the parser, so cannot be compiled
+         bad = 1;
+         return TEMPLATENONE;
+      }
+      return p - t->buf;
+   }
+   uint32_t a = 0;
+   for (n = 0, x = t->tokens; x; x = x->next, n++)
+   {
+      tt[n].next = tok (x->next);
+      tt[n].start = tok (x->start);
+      tt[n].end = tok (x->end);
+      tt[n].content = str (x->content);
+      tt[n].attr = a;
+      tt[n].attrs = x->attrs;
+      tt[n].line = x->line;
+      tt[n].level = x->level;
+      tt[n].type = x->type;
+      tt[n].utf8 = x->utf8;
+      tt[n].tag = x->tag;
+      int q;
+      for (q = 0; q < x->attrs; q++, a++)
+      {
+         ta[a].attribute = str (x->attr[q].attribute);
+         ta[a].value = str (x->attr[q].value);
+      }
+   }
+   char *path = templatepath (t->filename);
+   if (!bad && path)
+   {                            // write to temporary file and rename, so readers never see a partial file
+      char *temp = NULL;
+      if (asprintf (&temp, "%s/.xmlsqltXXXXXX", templatecache) < 0)
+         errx (1, "malloc at line %d", __LINE__);
+      int f = mkstemp (temp);
+      if (f < 0)
+         warn ("Template cache [%s]", temp);
+      else
+      {
+         FILE *o = fdopen (f, "w");
+         if (!o)
+         {
+            warn ("Template cache [%s]", temp);
+            close (f);
+            unlink (temp);
+         } else
+         {
+            fchmod (f, 0644);
+            int e = (fwrite (&h, sizeof (h), 1, o) != 1 || fwrite (tt, sizeof (*tt), tokens, o) != tokens
+                     || fwrite (ta, sizeof (*ta), attrs, o) != attrs || fwrite (t->buf, 1, buflen, o) != buflen);
+            if (fclose (o) || e || rename (temp, path))
+            {
+               warn ("Template cache [%s]", path);
+               unlink (temp);
+            } else if (debug)
+               fprintf (stderr, "Compiled %s: %u tokens\n", t->filename, tokens);
+         }
+      }
+      free (temp);
+   }
+   free (path);
+   free (hash);
+   free (index);
+   free (tt);
+   free (ta);
+}
+
+xmltoken *
+loadtemplate (char *fn)
+{                               // load a file, using the cached parse if the file is unchanged
+   if (!fn || !*fn)
+      return loadfile (fn, NULL, NULL, NULL);   // error
+   template_t *t,
+   **tp;
+   if (!strcmp (fn, "-"))
+   {                            // stdin, not kept, but freed by templatepurge like a replaced template
+      t = malloc (sizeof (*t));
+      if (!t)
+         errx (1, "malloc at line %d", __LINE__);
+      memset (t, 0, sizeof (*t));
+      t->filename = strdup (fn);
+      if (!t->filename)
+         errx (1, "malloc at line %d", __LINE__);
+      t->arena = xmlarenanew (0);
+      t->tokens = loadfile (fn, &t->buf, &t->maplen, t->arena);
+      t->next = templatesold;
+      templatesold = t;
+      return t->tokens;
+   }
+   struct stat s;
+   char *real = realpath (fn, NULL);    // key, so the same relative name from different directories is not confused
+   if (!real || stat (real, &s))
+   {
+      warn ("Loading file [%s]", fn);
+      free (real);
+      return NULL;
+   }
+   for (tp = &templates; (t = *tp) && strcmp (t->filename, real); tp = &t->next);
+   if (t)
+   {
+      if (t->dev == s.st_dev && t->ino == s.st_ino && t->size == s.st_size && t->mtime.tv_sec == s.st_mtim.tv_sec
+          && t->mtime.tv_nsec == s.st_mtim.tv_nsec)
+      {
+         free (real);
+         return t->tokens;
+      }
+      *tp = t->next;            // changed
+      t->next = templatesold;
+      templatesold = t;
+   }
+   t = malloc (sizeof (*t));
+   if (!t)
+      errx (1, "malloc at line %d", __LINE__);
+   memset (t, 0, sizeof (*t));
+   t->filename = real;
+   t->dev = s.st_dev;
+   t->ino = s.st_ino;
+   t->size = s.st_size;
+   t->mtime = s.st_mtim;
+   if (!templatecache || templatemap (t))
+   {
+      t->arena = xmlarenanew (s.st_size * 2);   // tokens and attributes typically take a bit more than the source
+      t->tokens = loadfile (fn, &t->buf, &t->maplen, t->arena);
+      if (!t->tokens)
+      {
+         arenafree (t->arena);
+         if (t->maplen)
+            munmap (t->buf, t->maplen);
+         else
+            free (t->buf);
+         free (t->filename);
+         free (t);
+         return NULL;
+      }
+      if (templatecache)
+         templatesave (t);
+   }
+   t->next = templates;
+   templates = t;
+   return t->tokens;
+}
+
+void
+templatepurge (void)
+{                               // free replaced templates, only once nothing is being processed
+   template_t *t;
+   while ((t = templatesold))
+   {
+      templatesold = t->next;
+      arenafree (t->arena);
+      if (t->maplen)
+         munmap (t->buf, t->maplen);
+      else
+         free (t->buf);
+      free (t->filename);
+      free (t);
+   }
+}
+
+static void
+runbegin (void)
+{                               // start of a script
+   level = 0;
+   memset (sqlactive, 0, sizeof (sqlactive));
+   iflast = 0;
+}
+
+static void
+runend (void)
+{                               // end of a script
+   if (sqlparallels)
+      sqlparalleldone ();
+   sqlmemodone ();
+   if (sqlstats)
+      sqlstatsdone ();
+}
+
+void
+runtemplate (xmltoken * x)
+{                               // process a whole script
+   runbegin ();
+   if (parallelsql)
+      sqlparallelstart (x);
+   processxml (x, 0, 0);
+   runend ();
+}
+
+#define	STREAMDEPTH	100     // open tags tracked for --stream
+void
+runstream (void)
+{                               // process a script from stdin as it arrives, each part once every tag in ENDMATCH in it is closed
+   char *fntag = varget ("SCRIPT_NAME") ? : "-";
+   if (strrchr (fntag, '/'))
+      fntag = strrchr (fntag, '/') + 1;
+   size_t all = 65536,
+      len = 0,
+      scan = 0,                 // scanned up to
+      cut = 0,                  // can process up to
+      tagstart = 0;
+   char *buf = malloc (all);
+   if (!buf)
+      errx (1, "malloc at line %d", __LINE__);
+   int line = 1,                // line of start of buf
+      depth = 0,
+      eof = 0;
+   enum
+   { TEXT, TAG, COMMENT, SCRIPT } state = TEXT;
+   char quote = 0,
+      prev = 0;
+   char open[STREAMDEPTH][16];  // open tags, upper case
+   char at (size_t i)
+   {
+      return i < len ? buf[i] : 0;
+   }
+   void tagend (size_t i)
+   {                            // tag from tagstart ends at i, track open tags
+      size_t p = tagstart + 1;
+      char end = 0,
+         name[16];
+      int n = 0;
+      if (buf[p] == '/')
+      {
+         end = 1;
+         p++;
+      }
+      while ((isalnum (buf[p]) || buf[p] == '-' || buf[p] == '_') && n < sizeof (name) - 1)
+         name[n++] = toupper (buf[p++]);
+      name[n] = 0;
+      char *m = strstr ("\t" ENDMATCH "\t", name);
+      if (!n || !m || m[-1] != '\t' || m[n] != '\t')
+         m = NULL;              // not matched to its end
+      if (!end && buf[i - 1] != '/')
+      {
+         if (m)
+         {
+            if (depth < STREAMDEPTH)
+               strcpy (open[depth], name);
+            depth++;
+         }
+         if (!strcmp (name, "SCRIPT"))
+            state = SCRIPT;     // special parsing of script content
+      } else if (end && m)
+      {                         // as xmlendmatch, unstack till match, but not past an IF
+         int q = (depth < STREAMDEPTH ? depth : STREAMDEPTH);
+         while (q && strcmp (open[q - 1], name))
+         {
+            if (!strcmp (open[q - 1], "IF"))
+            {
+               q = 0;
+               break;
+            }
+            q--;
+         }
+         if (q)
+            depth = q - 1;
+      }
+   }
+   while (!eof || len)
+   {
+      if (!eof)
+      {
+         if (len + 1 >= all && !(buf = realloc (buf, all *= 2)))
+            errx (1, "malloc at line %d", __LINE__);
+         ssize_t l = read (fileno (stdin), buf + len, all - len - 1);
+         if (l < 0 && errno == EINTR)
+            continue;
+         if (l < 0)
+            err (1, "Reading stdin");
+         if (!l)
+            eof = 1;
+         len += l;
+      }
+      while (scan < len)
+      {
+         char c = buf[scan];
+         if (state == TEXT)
+         {
+            if (!depth)
+               cut = scan;
+            if (c == '<')
+            {
+               if (scan + 4 > len && !eof)
+                  break;        // need to see what follows
+               if (at (scan + 1) == '!' && at (scan + 2) == '-' && at (scan + 3) == '-')
+               {
+                  state = COMMENT;
+                  scan += 4;
+                  continue;
+               }
+               if ((at (scan + 1) == '/' && isalpha (at (scan + 2))) || isalpha (at (scan + 1)))
+               {
+                  state = TAG;
+                  tagstart = scan;
+                  quote = 0;
+               }
+            }
+         } else if (state == TAG)
+         {
+            if (quote)
+            {
+               if (c == quote)
+                  quote = 0;
+            } else if ((c == '"' || c == '\'') && (prev == '=' || isspace (prev)))
+               quote = c;
+            else if (c == '>')
+            {
+               state = TEXT;
+               tagend (scan);
+            }
+         } else if (state == COMMENT)
+         {
+            if (c == '-')
+            {
+               if (scan + 3 > len && !eof)
+                  break;
+               if (at (scan + 1) == '-' && at (scan + 2) == '>')
+               {
+                  state = TEXT;
+                  scan += 3;
+                  continue;
+               }
+            }
+         } else if (c == '<')
+         {                      // SCRIPT
+            if (scan + 9 > len && !eof)
+               break;
+            if (len - scan >= 9 && !strncasecmp (buf + scan, "</script>", 9))
+            {
+               state = TEXT;
+               continue;
+            }
+         }
+         prev = c;
+         scan++;
+      }
+      if (state == TEXT && !depth)
+         cut = scan;
+      if (eof)
+         cut = len;
+      if (!cut)
+         continue;
+      // Process complete part
+      char *part = malloc (cut + 1);
+      if (!part)
+         errx (1, "malloc at line %d", __LINE__);
+      memcpy (part, buf, cut);
+      part[cut] = 0;
+      xmlarena *arena = xmlarenanew (0);
+      xmltoken *x = xmlparse (part, fntag, arena),
+         *t;
+      for (t = x; t; t = t->next)
+         t->line += line - 1;
+      size_t i;
+      for (i = 0; i < cut; i++)
+         if (buf[i] == '\n')
+            line++;
+      xmlendmatch (x, ENDMATCH);
+      tagcode (x, arena);
+      processxml (x, 0, 0);
+      arenafree (arena);
+      free (part);
+      memmove (buf, buf + cut, len - cut);
+      len -= cut;
+      scan -= cut;
+      tagstart -= cut;
+      cut = 0;
+   }
+   free (buf);
+}
+
+// SCGI server, the parsed templates and the SQL connection are kept between requests
+static int
+scgirequest (int s, char ***envp)
+{                               // read SCGI request headers, set envp to malloced NULL terminated name=value list
+   char *h = NULL,
+      *c;
+   unsigned long len = 0;
+   int l = 0;
+   char d;
+   while ((l = read (s, &d, 1)) == 1 && isdigit (d) && len < 1000000)
+      len = len * 10 + d - '0';
+   if (l != 1 || d != ':' || !len)
+      return -1;
+   h = malloc (len + 1);
+   if (!h)
+      errx (1, "malloc at line %d", __LINE__);
+   unsigned long p = 0;
+   while (p <= len && (l = read (s, h + p, len + 1 - p)) > 0)
+      p += l;
+   if (p <= len || h[len] != ',')
+   {
+      free (h);
+      return -1;
+   }
+   h[len] = 0;
+   int n = 0;
+   for (p = 0; p < len; p++)
+      if (!h[p])
+         n++;
+   char **env = malloc (sizeof (*env) * (n / 2 + 1));
+   if (!env)
+      errx (1, "malloc at line %d", __LINE__);
+   n = 0;
+   for (c = h; c < h + len;)
+   {                            // name NUL value NUL
+      char *v = c + strlen (c) + 1;
+      if (v >= h + len)
+         break;
+      if (asprintf (&env[n], "%s=%s", c, v) < 0)
+         errx (1, "malloc at line %d", __LINE__);
+      n++;
+      c = v + strlen (v) + 1;
+   }
+   env[n] = NULL;
+   free (h);
+   *envp = env;
+   return 0;
+}
+
+static void
+scgiform (const char *q)
+{                               // set variables from url encoded form data, not replacing request headers
+   if (!q)
+      return;
+   char *f = strdup (q),
+      *p = f;
+   if (!f)
+      errx (1, "malloc at line %d", __LINE__);
+   int hex (char c)
+   {
+      return isdigit (c) ? c - '0' : tolower (c) - 'a' + 10;
+   }
+   while (*p)
+   {                            // decode in place, name=value&...
+      char *n = p,
+         *o = p,
+         *v = NULL;
+      while (*p && *p != '&' && *p != ';')
+      {
+         if (*p == '=' && !v)
+         {
+            *o++ = 0;
+            v = o;
+            p++;
+         } else if (*p == '+')
+         {
+            *o++ = ' ';
+            p++;
+         } else if (*p == '%' && isxdigit (p[1]) && isxdigit (p[2]))
+         {
+            *o++ = hex (p[1]) * 16 + hex (p[2]);
+            p += 3;
+         } else
+            *o++ = *p++;
+      }
+      if (*p)
+         p++;
+      *o = 0;
+      if (*n && !varget (n))
+         varset (n, v ? : "");
+   }
+   free (f);
+}
+
+static void
+scgibody (int s)
+{                               // read request body, setting variables if a url encoded form
+   const char *cl = varget ("CONTENT_LENGTH");
+   unsigned long len = (cl ? strtoul (cl, NULL, 10) : 0);
+   if (!len || len > SCGIPOSTMAX)
+      return;
+   char *b = malloc (len + 1);
+   if (!b)
+      errx (1, "malloc at line %d", __LINE__);
+   unsigned long p = 0;
+   int l;
+   while (p < len && (l = read (s, b + p, len - p)) > 0)
+      p += l;
+   b[p] = 0;
+   const char *ct = varget ("CONTENT_TYPE");
+   if (ct && !strncasecmp (ct, "application/x-www-form-urlencoded", 33))
+      scgiform (b);
+   free (b);
+}
+
+int
+scgiserver (const char *infile)
+{                               // listen on unix socket, and fork workers to handle requests
+   int s = socket (AF_UNIX, SOCK_STREAM, 0);
+   if (s < 0)
+      err (1, "socket");
+   struct sockaddr_un a = {.sun_family = AF_UNIX };
+   if (strlen (scgi) >= sizeof (a.sun_path))
+      errx (1, "SCGI socket path too long [%s]", scgi);
+   strcpy (a.sun_path, scgi);
+   unlink (scgi);
+   if (bind (s, (struct sockaddr *) &a, sizeof (a)))
+      err (1, "bind [%s]", scgi);
+   if (listen (s, 128))
+      err (1, "listen [%s]", scgi);
+   const char *securityarg = security;  // from command line or environment we started with
+   int home = open (".", O_RDONLY | O_DIRECTORY);       // each request runs in the directory of its script, as CGI does
+   if (home < 0)
+      err (1, "Current directory");
+   if (infile)
+      infile = realpath (infile, NULL) ? : infile;
+   void worker (void)
+   {
+      signal (SIGPIPE, SIG_IGN);
+      int requests = 0;
+      while (requests++ < SCGIREQUESTS)
+      {
+         int c = accept (s, NULL, NULL);
+         if (c < 0)
+         {
+            if (errno == EINTR)
+               continue;
+            err (1, "accept");
+         }
+         alarm (600);           // be careful!
+         struct timeval tv = {.tv_sec = SCGITIMEOUT };
+         setsockopt (c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));     // a client sending nothing does not hold the worker
+         char **env = NULL;
+         if (scgirequest (c, &env))
+         {
+            close (c);
+            alarm (0);
+            continue;
+         }
+         varclear ();           // the environment is not changed, so is as we started
+         char **e;
+         for (e = env; *e; e++)
+         {                      // request headers
+            char *v = strchr (*e, '=');
+            *v++ = 0;
+            varset (*e, v);
+            free (*e);
+         }
+         free (env);
+         scgiform (varget ("QUERY_STRING"));
+         scgibody (c);
+         of = fdopen (c, "w");
+         if (!of)
+            err (1, "fdopen");
+         if (sqltiming)
+            of = outcount (of);
+         outopen (of);
+         if (contenttype)
+            fprintf (of, "Content-Type: text/html\r\n\r\n");
+         security = securityarg ? : varget (QUOTE (SECURITYTAG));
+         char *fn = (char *) (infile ? : varget ("SCRIPT_FILENAME") ? : varget ("PATH_TRANSLATED"));
+         xmltoken *x = loadtemplate (fn);
+         char *dir = (fn ? strdup (fn) : NULL),
+            *slash = (dir ? strrchr (dir, '/') : NULL);
+         if (slash)
+         {
+            slash[slash == dir] = 0;    // keep / for root
+            if (chdir (dir))
+               warn ("Script directory [%s]", dir);
+         }
+         free (dir);
+         sqlreset ();           // nothing left from the last request, reconnect on next use if not answering
+         if (x)
+            runtemplate (x);
+         fclose (of);
+         of = NULL;
+         templatepurge ();
+         if (fchdir (home))
+            err (1, "Current directory");
+         alarm (0);
+      }
+      sqlclose (0);
+      exit (0);
+   }
+   int n;
+   for (n = 0; n < scgiworkers; n++)
+      if (!fork ())
+         worker ();
+   while (1)
+   {                            // restart workers that exit or die
+      int status = 0;
+      if (wait (&status) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         err (1, "wait");
+      }
+      if (!WIFEXITED (status) || WEXITSTATUS (status))
+         sleep (1);             // don't spin on failure
+      if (!fork ())
+         worker ();
+   }
+}
+
 int
 main (int argc, const char *argv[])
 {
@@ -4371,7 +7811,6 @@ main (int argc, const char *argv[])
    char *infile = 0;
    char *outfile = 0;
    char *test = 0;
-   int contenttype = 0;
    poptContext optCon;          // context for parsing command-line options
    const struct poptOption optionsTable[] = {
       {"sql-conf", 0, POPT_ARGFLAG_SHOW_DEFAULT | POPT_ARG_STRING, &sqlconf, 0, "Client config file ($SQL_CNF_FILE)", "filename"},
@@ -4392,6 +7831,16 @@ main (int argc, const char *argv[])
       {"no-form", 'f', POPT_ARG_NONE, &noform, 0, "Remove forms and change inputs to text"},
       {"security", 0, POPT_ARG_STRING, &security, 0, "Add hidden field to forms", "value"},
       {"show-hidden", 's', POPT_ARG_NONE, &showhidden, 0, "Remove type=hidden in input"},
+      {"scgi", 0, POPT_ARG_STRING, &scgi, 0, "Run as SCGI server, keeping parsed scripts and SQL connection", "socket"},
+      {"template-cache", 0, POPT_ARG_STRING, &templatecache, 0, "Directory for compiled scripts", "dir"},
+      {"cache-dir", 0, POPT_ARG_STRING, &cachedir, 0, "Directory for SQL CACHE results", "dir"},
+      {"scgi-workers", 0, POPT_ARG_INT, &scgiworkers, 0, "SCGI worker processes", "N"},
+      {"schema-ttl", 0, POPT_ARG_INT, &schemattl, 0, "Seconds to keep table details for enum SELECT and KEY templates (0 not kept)", "seconds"},
+      {"sql-stats", 0, POPT_ARG_NONE, &sqlstats, 0, "Report time, rows and bytes for each SQL at the end"},
+      {"slow-query-ms", 0, POPT_ARG_INT, &slowqueryms, 0, "Log SQL taking this long to query and fetch", "ms"},
+      {"slow-query-log", 0, POPT_ARG_STRING, &slowquerylog, 0, "File to append slow SQL JSON lines to, else stderr", "file"},
+      {"stream", 0, POPT_ARG_NONE, &streaminput, 0, "Process a script on stdin as it arrives"},
+      {"parallel-sql", 0, POPT_ARG_INT, &parallelsql, 0, "Run independent top level SQL on up to N extra connections at the start", "N"},
       {"dataurifold", 0, POPT_ARG_INT, &dataurifold, 0, "fold datauri (70 is good for qprint)"},
       {"max-input-size", 'm', POPT_ARG_INT, &maxinputsize, 0,
        "When setting size from database field, limit to this max (0=dont set)"},
@@ -4416,8 +7865,9 @@ main (int argc, const char *argv[])
    }
    if (!sqlconf)
       sqlconf = getenv ("SQL_CNF_FILE");
+   sqltiming = (sqlstats || slowqueryms > 0);
 
-   if (contenttype)
+   if (contenttype && !scgi)
       printf ("Content-Type: text/html\r\n\r\n");
 
    if (!security)
@@ -4454,50 +7904,63 @@ main (int argc, const char *argv[])
       poptPrintUsage (optCon, stderr, 0);
       return 2;
    }
+   xmlgetenv = varget;          // so parsing sees our variables
+   escinit ();
+   if (scgi)
+      return scgiserver (infile ? : poptGetArg (optCon));
+
    if (!outfile || !strcmp (outfile, "-"))
       of = stdout;
    else
       of = fopen (outfile, "w");
    if (!of)
       err (1, "Opening output [%s]", outfile ? : "-");
+   if (sqltiming)
+      of = outcount (of);
+   outopen (of);
 
    if (!infile && !poptPeekArg (optCon) && !test)
       infile = "-";             // stdin by default
 
    alarm (600);                 // be careful!
 
+   runbegin ();                 // test and files are run as one script
+   int first = 1;
    if (test)
    {
-      x = xmlparse ((char *) test, "test");
+      xmlarena *arena = xmlarenanew (0);
+      x = xmlparse ((char *) test, "test", arena);
       if (!x)
          warnx ("Cannot parse test\n");
-      xmlendmatch (x, "IF\tSQL\tWHILE\tFOR\tTEXTAREA\tSELECT\tLATER\tXMLSQL\tFORM\tDIR");
+      xmlendmatch (x, ENDMATCH);
+      tagcode (x, arena);
+      if (parallelsql)
+         sqlparallelstart (x);
+      processxml (x, 0, 0);
+      first = 0;
    }
 
    while (1)
-   {                            // Load file(s)
+   {                            // Load and process file(s) in turn
       char *fn = infile;
       if (!fn)
          fn = (char *) poptGetArg (optCon);
       if (!fn)
          break;                 // end of files
-      xmltoken *n = loadfile (fn);
-      if (!x)
-         x = n;
-      else if (n)
-      {                         // append
-         xmltoken *e = x;
-         while (e->next)
-            e = e->end ? : e->next;
-         if (e)
-            e->next = n;
+      if (streaminput && !strcmp (fn, "-"))
+         runstream ();
+      else if ((x = loadtemplate (fn)))
+      {
+         if (first && parallelsql)
+            sqlparallelstart (x);       // later files may depend on changes made by earlier ones
+         processxml (x, 0, 0);
       }
+      first = 0;
       if (infile)
          break;                 // have done the one explicitly specified file
    }
-   // Process file
-   processxml (x, 0, 0);
-   if (sqlconnected)
-      sql_close (&sql);
+   runend ();
+   templatepurge ();
+   sqlclose (0);
    return 0;
 }